@@ -0,0 +1,250 @@
+#include "accumulator.h"
+#include "cpu.h"
+
+#include <cstring>
+
+
+namespace Shahrazad {
+namespace nnue {
+
+// feature of a dirty piece on one of its squares, -1 if it's not on the board there
+static int dirty_feature(const NNue&       network,
+                         types::Color      perspective,
+                         types::Square     king,
+                         const DirtyPiece& dp,
+                         types::Square     square) {
+    if (square == types::Square::NONE)
+    {
+        return -1;
+    }
+
+    return network.feature(perspective, king, dp.piece, square, dp.color);
+}
+
+// features a move removed and added for 'perspective', straight from the pieces it changed
+static void changed_features(const NNue&        network,
+                             const DirtyPieces& dirty,
+                             types::Color       perspective,
+                             types::Square      king,
+                             FeatureList&       removed,
+                             FeatureList&       added) {
+    for (int i = 0; i < dirty.count; i++)
+    {
+        const int from = dirty_feature(network, perspective, king, dirty.pieces[i], dirty.pieces[i].from);
+        const int to   = dirty_feature(network, perspective, king, dirty.pieces[i], dirty.pieces[i].to);
+
+        if (from >= 0)
+            removed.push_back(from);
+        if (to >= 0)
+            added.push_back(to);
+    }
+}
+
+// bitboard of one kind of piece
+static uint64_t pieces_of(const position::Position& pos, types::Color color, types::PieceType piece_type) {
+    const bool white = color == types::Color::WHITE;
+
+    switch (piece_type)
+    {
+    case types::PieceType::KING :
+        return (white ? pos.white_king : pos.black_king).board();
+    case types::PieceType::QUEEN :
+        return (white ? pos.white_queens : pos.black_queens).board();
+    case types::PieceType::ROOK :
+        return (white ? pos.white_rooks : pos.black_rooks).board();
+    case types::PieceType::BISHOP :
+        return (white ? pos.white_bishops : pos.black_bishops).board();
+    case types::PieceType::KNIGHT :
+        return (white ? pos.white_knights : pos.black_knights).board();
+    case types::PieceType::PAWN :
+        return (white ? pos.white_pawns : pos.black_pawns).board();
+    default :
+        return 0;
+    }
+}
+
+void RefreshCache::clear() {
+    for (Entry& entry : entries)
+    {
+        entry.valid[0] = false;
+        entry.valid[1] = false;
+    }
+}
+
+void RefreshCache::refresh(const position::Position& pos,
+                           const NNue&               network,
+                           types::Color              perspective,
+                           NNue::Accumulator<size>&  accumulator) {
+    assert(network.id() && "NNUE evaluation needs a loaded network (EvalFile)");
+
+    // entries built from another network are worthless
+    if (network.id() != network_id)
+    {
+        clear();
+        network_id = network.id();
+    }
+
+    const types::Square king  = pos.king_square(perspective);
+    Entry&              entry = entries[network.king_slot(perspective, king)];
+    FeatureList         removed;
+    FeatureList         added;
+
+    // first use of this slot since the cache was cleared : the biases, built from no piece at all
+    if (!entry.valid[static_cast<int>(perspective)])
+    {
+        std::memcpy(entry.accumulator[perspective], network.l_0.getBias(), size * sizeof(int16_t));
+        std::memset(entry.pieces[static_cast<int>(perspective)], 0, sizeof(entry.pieces[0]));
+        entry.valid[static_cast<int>(perspective)] = true;
+    }
+
+    for (auto color : {types::Color::WHITE, types::Color::BLACK})
+    {
+        for (int pt = 0; pt < 6; pt++)
+        {
+            const types::PieceType piece_type = types::PieceType(pt);
+            uint64_t&              cached     = entry.pieces[static_cast<int>(perspective)][static_cast<int>(color)][pt];
+            const uint64_t         current    = pieces_of(pos, color, piece_type);
+
+            for (uint64_t gone = cached & ~current; gone; gone &= gone - 1)
+                removed.push_back(
+                  network.feature(perspective, king, piece_type, types::Square(__builtin_ctzll(gone)), color));
+
+            for (uint64_t come = current & ~cached; come; come &= come - 1)
+                added.push_back(
+                  network.feature(perspective, king, piece_type, types::Square(__builtin_ctzll(come)), color));
+
+            cached = current;
+        }
+    }
+
+    cpu::kernels().update_accumulator(network.l_0, entry.accumulator, entry.accumulator, removed, added, perspective);
+    std::memcpy(accumulator[perspective], entry.accumulator[perspective], size * sizeof(int16_t));
+}
+
+void AccumulatorStack::push(const DirtyPieces& dirty) {
+    assert(top + 1 < ACCUMULATOR_STACK_SIZE);
+
+    Entry& entry = entries[++top];
+    entry.dirty  = dirty;
+
+    for (int p = 0; p < 2; p++)
+    {
+        entry.computed[p]   = false;
+        entry.king_moved[p] = false;
+    }
+
+    for (int i = 0; i < dirty.count; i++)
+    {
+        if (dirty.pieces[i].piece == types::PieceType::KING)
+        {
+            entry.king_moved[static_cast<int>(dirty.pieces[i].color)] = true;
+        }
+    }
+}
+
+bool AccumulatorStack::needs_refresh(const Entry& entry, const NNue& network, types::Color perspective) const {
+    if (!entry.king_moved[static_cast<int>(perspective)])
+    {
+        return false;
+    }
+
+    for (int i = 0; i < entry.dirty.count; i++)
+    {
+        const DirtyPiece& dp = entry.dirty.pieces[i];
+
+        if (dp.piece == types::PieceType::KING && dp.color == perspective)
+        {
+            return network.king_slot(perspective, dp.from) != network.king_slot(perspective, dp.to);
+        }
+    }
+
+    return false;
+}
+
+NNue::Accumulator<size>& AccumulatorStack::current(const position::Position& pos, const NNue& network) {
+    // usually both perspectives start from the same computed ply, they are then updated together
+    if (!entries[top].computed[0] && !entries[top].computed[1])
+    {
+        const int last = last_computed(network, types::Color::WHITE);
+
+        if (last == last_computed(network, types::Color::BLACK) && entries[last].computed[0]
+            && entries[last].computed[1])
+        {
+            update_both(pos, network, last);
+            return entries[top].accumulator;
+        }
+    }
+
+    for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+    {
+        if (!entries[top].computed[static_cast<int>(perspective)])
+        {
+            update(pos, network, perspective);
+        }
+    }
+
+    return entries[top].accumulator;
+}
+
+int AccumulatorStack::last_computed(const NNue& network, types::Color perspective) const {
+    const int p = static_cast<int>(perspective);
+
+    // walk back to the last computed accumulator, unless a king move to another slot on the way forces a
+    // refresh. Within a slot the king is just another piece
+    int last = top;
+
+    while (last > 0 && !entries[last].computed[p] && !needs_refresh(entries[last], network, perspective))
+        last--;
+
+    return last;
+}
+
+void AccumulatorStack::update(const position::Position& pos, const NNue& network, types::Color perspective) {
+    const int p    = static_cast<int>(perspective);
+    const int last = last_computed(network, perspective);
+
+    if (!entries[last].computed[p])
+    {
+        refresh_cache.refresh(pos, network, perspective, entries[top].accumulator);
+        entries[top].computed[p] = true;
+        return;
+    }
+
+    // the king stayed in its slot since, every feature is relative to the square it is on now
+    const types::Square king = pos.king_square(perspective);
+
+    for (int ply = last + 1; ply <= top; ply++)
+    {
+        FeatureList removed;
+        FeatureList added;
+        changed_features(network, entries[ply].dirty, perspective, king, removed, added);
+
+        cpu::kernels().update_accumulator(network.l_0, entries[ply].accumulator, entries[ply - 1].accumulator, removed,
+                                          added, perspective);
+        entries[ply].computed[p] = true;
+    }
+}
+
+void AccumulatorStack::update_both(const position::Position& pos, const NNue& network, int last) {
+    const types::Square kings[2] = {pos.king_square(types::Color::WHITE), pos.king_square(types::Color::BLACK)};
+
+    for (int ply = last + 1; ply <= top; ply++)
+    {
+        FeatureList removed[2];
+        FeatureList added[2];
+
+        for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+        {
+            const int p = static_cast<int>(perspective);
+            changed_features(network, entries[ply].dirty, perspective, kings[p], removed[p], added[p]);
+        }
+
+        cpu::kernels().update_accumulators(network.l_0, entries[ply].accumulator, entries[ply - 1].accumulator,
+                                           removed, added);
+        entries[ply].computed[0] = true;
+        entries[ply].computed[1] = true;
+    }
+}
+
+}  // namespace nnue
+}  // namespace Shahrazad
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "nnue.h"
+#include "position.h"
+#include "types.h"
+
+
+namespace Shahrazad {
+namespace nnue {
+
+constexpr int ACCUMULATOR_STACK_SIZE = 256 + 1;  // one entry per ply of the deepest search, plus the root
+
+// a piece a move changed : it went 'from' -> 'to', 'to' is NONE when it was captured
+struct DirtyPiece {
+    types::PieceType piece;
+    types::Color     color;
+    types::Square    from;
+    types::Square    to;
+};
+
+// every piece changed by a move, at most 3 (a castling or a capture with a promotion)
+struct DirtyPieces {
+    int        count = 0;
+    DirtyPiece pieces[3];
+
+    void add(types::PieceType piece, types::Color color, types::Square from, types::Square to) {
+        pieces[count++] = {piece, color, from, to};
+    }
+};
+
+// Refresh cache ("Finny table") : for every king slot (bucket and side of the board), the accumulator of
+// each perspective last built with its king there and the pieces it was built from. A refresh starts from that accumulator and only
+// applies the pieces that differ, usually a handful of updates instead of rebuilding from every piece
+class RefreshCache {
+   public:
+    // forgets every entry, each is rebuilt from the biases of the network the first time its slot is refreshed.
+    // Nothing is read from the network here, there may be none loaded yet. refresh() does it by itself when
+    // the network changed, the entries are exact otherwise and stay valid from one search to the next
+    void clear();
+
+    // accumulator of 'perspective' for 'pos', written into 'accumulator'
+    void refresh(const position::Position& pos,
+                 const NNue&               network,
+                 types::Color              perspective,
+                 NNue::Accumulator<size>&  accumulator);
+
+   private:
+    struct Entry {
+        NNue::Accumulator<size> accumulator;
+        uint64_t                pieces[2][2][6];  // [perspective][color][piece type]
+        bool                    valid[2];         // [perspective], false until built from the biases
+    };
+
+    Entry    entries[MAX_KING_BUCKETS * 2];  // by king slot
+    uint32_t network_id = 0;                 // network the entries were built from, see NNue::id
+};
+
+// Accumulators of one thread, one per ply. Making a move only records the pieces it changed, the
+// accumulator itself is brought up to date the first time the position is evaluated by walking back to
+// the last computed one and applying the recorded changes from there. Nodes that are cut off before
+// their static evaluation never pay for an update
+class AccumulatorStack {
+   public:
+    // new root position, nothing computed yet. The refresh cache keeps its entries, they are still right
+    // for the new position and save the first refreshes of the search
+    void reset() {
+        top                    = 0;
+        entries[0].computed[0] = false;
+        entries[0].computed[1] = false;
+    }
+
+    // a new game, the refresh cache starts over
+    void clear_refresh_cache() { refresh_cache.clear(); }
+
+    void push(const DirtyPieces& dirty);
+    void pop() {
+        assert(top > 0);
+        top--;
+    }
+
+    // the accumulator of 'pos', which has to be the position of the top entry
+    NNue::Accumulator<size>& current(const position::Position& pos, const NNue& network);
+
+   private:
+    struct Entry {
+        NNue::Accumulator<size> accumulator;
+        DirtyPieces             dirty;
+        bool                    computed[2];
+        bool                    king_moved[2];
+    };
+
+    // the king of 'perspective' changed slot on this entry's move, every feature of that perspective changed
+    bool needs_refresh(const Entry& entry, const NNue& network, types::Color perspective) const;
+
+    // ply the accumulator of 'perspective' can be updated from, refreshed when it isn't computed
+    int  last_computed(const NNue& network, types::Color perspective) const;
+    void update(const position::Position& pos, const NNue& network, types::Color perspective);
+
+    // both perspectives together, from the ply 'last' where both are computed
+    void update_both(const position::Position& pos, const NNue& network, int last);
+
+    Entry        entries[ACCUMULATOR_STACK_SIZE];
+    int          top = 0;
+    RefreshCache refresh_cache;
+};
+
+}  // namespace nnue
+}  // namespace Shahrazad
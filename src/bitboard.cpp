@@ -1,4 +1,5 @@
 #include "bitboard.h"
+#include "cpu.h"
 #include <iostream>
 
 
@@ -20,15 +21,12 @@ void Bitboard::move_bit(const uint8_t& start_pos, const uint8_t& end_pos) {
 }
 
 uint8_t Bitboard::square() const {
-    for (int i = 0; i < 64; i++)
+    if (!bit_board)
     {
-        if (is_bitset(i))
-        {
-            return i;
-        }
+        return -1;
     }
 
-    return -1;
+    return cpu::kernels().lsb(bit_board);
 }
 
 void Bitboard::print() const {
@@ -50,18 +48,7 @@ void Bitboard::print() const {
     }
 }
 
-uint8_t Bitboard::count() const {
-    int count = 0;
-
-    for (int i = 0; i < 64; i++)
-    {
-        if (is_bitset(i))
-        {
-            count++;
-        }
-    }
-    return count;
-}
+uint8_t Bitboard::count() const { return cpu::kernels().popcount(bit_board); }
 
 }  // namespace board
 }  // namespace Shahrazad
\ No newline at end of file
@@ -0,0 +1,114 @@
+#include "cpu.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+static const Kernels* table_for(Level level) {
+    switch (level)
+    {
+#if defined(__x86_64__) || defined(_M_X64)
+    case Level::SSE41 :
+        return &kernels_sse41;
+    case Level::AVX2 :
+        return &kernels_avx2;
+    case Level::BMI2 :
+        return &kernels_bmi2;
+    case Level::AVX512 :
+        return &kernels_avx512;
+    case Level::AVX512VNNI :
+        return &kernels_vnni;
+#endif
+    default :
+        return &kernels_generic;
+    }
+}
+
+Level detect() {
+#if defined(__x86_64__) || defined(_M_X64)
+    __builtin_cpu_init();
+
+    const bool sse41  = __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt");
+    const bool avx2   = sse41 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    const bool bmi2   = avx2 && __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+    const bool avx512 = bmi2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+
+    if (avx512 && __builtin_cpu_supports("avx512vnni"))
+    {
+        return Level::AVX512VNNI;
+    }
+    if (avx512)
+    {
+        return Level::AVX512;
+    }
+    if (bmi2)
+    {
+        return Level::BMI2;
+    }
+    if (avx2)
+    {
+        return Level::AVX2;
+    }
+    if (sse41)
+    {
+        return Level::SSE41;
+    }
+#endif
+
+    return Level::SCALAR;
+}
+
+bool supported(Level level) { return static_cast<int>(level) <= static_cast<int>(detect()); }
+
+// chosen once, the first time any kernel is needed
+static const Kernels*& active() {
+    static const Kernels* table = table_for(detect());
+    return table;
+}
+
+const Kernels& kernels() { return *active(); }
+
+bool select(Level level) {
+    if (level >= Level::NB_LEVELS || !supported(level))
+    {
+        return false;
+    }
+
+    active() = table_for(level);
+    return true;
+}
+
+bool select(const std::string& name) {
+    for (int i = 0; i < static_cast<int>(Level::NB_LEVELS); i++)
+    {
+        if (name == level_name(Level(i)))
+        {
+            return select(Level(i));
+        }
+    }
+
+    return false;
+}
+
+const char* level_name(Level level) {
+    switch (level)
+    {
+    case Level::SCALAR :
+        return "scalar";
+    case Level::SSE41 :
+        return "sse41";
+    case Level::AVX2 :
+        return "avx2";
+    case Level::BMI2 :
+        return "bmi2";
+    case Level::AVX512 :
+        return "avx512";
+    case Level::AVX512VNNI :
+        return "avx512vnni";
+    default :
+        return "none";
+    }
+}
+
+}  // namespace cpu
+}  // namespace Shahrazad
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "nnue.h"
+#include "types.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace Shahrazad {
+namespace cpu {
+
+// instruction set levels the hot kernels are built for, each one implies the ones before it
+enum class Level : int {
+    SCALAR,      // baseline x86-64 (or whatever the target is on other architectures)
+    SSE41,       // + SSE4.1, POPCNT
+    AVX2,        // + AVX2, FMA
+    BMI2,        // + BMI1/BMI2 (tzcnt, pext)
+    AVX512,      // + AVX-512 F/BW
+    AVX512VNNI,  // + AVX-512 VNNI
+    NB_LEVELS
+};
+
+// one build of the hot kernels, the engine only calls them through the table of the selected level
+struct Kernels {
+    Level level;
+
+    void (*refresh_accumulator)(const nnue::LinearLayer&             layer,
+                                nnue::NNue::Accumulator<nnue::size>& new_acc,
+                                const nnue::FeatureList&             active_features,
+                                types::Color                         perspective);
+    void (*update_accumulator)(const nnue::LinearLayer&                   layer,
+                               nnue::NNue::Accumulator<nnue::size>&       new_acc,
+                               const nnue::NNue::Accumulator<nnue::size>& prev_acc,
+                               const nnue::FeatureList&                   removed_features,
+                               const nnue::FeatureList&                   added_features,
+                               types::Color                               perspective);
+    void (*update_accumulators)(const nnue::LinearLayer&                   layer,
+                                nnue::NNue::Accumulator<nnue::size>&       new_acc,
+                                const nnue::NNue::Accumulator<nnue::size>& prev_acc,
+                                const nnue::FeatureList*                   removed_features,
+                                const nnue::FeatureList*                   added_features);  // both perspectives
+    void (*clipped_relu_u8)(const int16_t* input, uint8_t* output, int count);
+    void (*affine_u8i8)(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                        int num_inputs, int num_outputs);
+    void (*affine_sparse_u8i8)(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                               int num_inputs, int num_outputs);  // weights in 4-input blocks
+
+    int (*popcount)(uint64_t bits);
+    int (*lsb)(uint64_t bits);  // index of the lowest set bit, 'bits' can't be empty
+};
+
+// the builds, one per kernels_*.cpp
+extern const Kernels kernels_generic;
+#if defined(__x86_64__) || defined(_M_X64)
+extern const Kernels kernels_sse41;
+extern const Kernels kernels_avx2;
+extern const Kernels kernels_bmi2;
+extern const Kernels kernels_avx512;
+extern const Kernels kernels_vnni;
+#endif
+
+// best level this cpu (and OS) supports, read from cpuid
+Level detect();
+bool  supported(Level level);
+
+// kernels in use, the best supported ones unless select() forced a level
+const Kernels& kernels();
+
+// forces a level (the "SimdLevel" option, for benchmarking), false if the cpu can't run it
+bool select(Level level);
+bool select(const std::string& name);
+
+const char* level_name(Level level);
+
+}  // namespace cpu
+}  // namespace Shahrazad
@@ -0,0 +1,22 @@
+// The default network is placed in the executable by the assembler (.incbin) so the engine needs no file
+// at startup. The Makefile passes its path in EMBEDDED_NET, without one the embedded network is empty and
+// nnue::init_network() needs an EvalFile. The data is aligned like a mapped file so it's used in place
+
+#if defined(__APPLE__)
+    #define EMBED_SECTION ".const_data\n"
+    #define EMBED_SYMBOL(name) "_" #name
+#else
+    #define EMBED_SECTION ".section .rodata\n"
+    #define EMBED_SYMBOL(name) #name
+#endif
+
+#if defined(EMBEDDED_NET)
+    #define EMBED_INCBIN ".incbin \"" EMBEDDED_NET "\"\n"
+#else
+    #define EMBED_INCBIN ""
+#endif
+
+__asm__(EMBED_SECTION ".global " EMBED_SYMBOL(shz_embedded_net) "\n"
+        ".global " EMBED_SYMBOL(shz_embedded_net_end) "\n"
+        ".balign 64\n" EMBED_SYMBOL(shz_embedded_net) ":\n" EMBED_INCBIN EMBED_SYMBOL(shz_embedded_net_end) ":\n"
+        ".text\n");
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "accumulator.h"
 #include "nnue.h"
 #include "position.h"
 #include <cassert>
@@ -7,7 +8,7 @@
 namespace Shahrazad {
 namespace eval {
 
-int simple_evaluate(const position::Position& pos) {
+inline int simple_evaluate(const position::Position& pos) {
     types::Color color = pos.getSide();
     int     eval  = 0;
 
@@ -20,7 +21,7 @@ int simple_evaluate(const position::Position& pos) {
     return eval;
 }
 
-int network_eval(const position::Position& pos, nnue::NNue network, nnue::NNue::Accumulator<nnue::size>& caches) {
+inline int network_eval(const position::Position& pos, const nnue::NNue& network, nnue::AccumulatorStack& accumulators) {
     assert(!pos.inCheck);
 
     bool use_smallnet = false;
@@ -28,7 +29,7 @@ int network_eval(const position::Position& pos, nnue::NNue network, nnue::NNue::
 
     if (std::abs(simple_eval) > 962)
     {
-        return network.nnue_eval(pos, caches);
+        return network.nnue_eval(pos, accumulators.current(pos, network));
     }
 
     return simple_eval;
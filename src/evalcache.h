@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+namespace Shahrazad {
+namespace eval {
+
+constexpr std::size_t EVAL_CACHE_SIZE = 1 << 16;  // entries, has to be a power of two
+
+// Small direct mapped cache of raw static evaluations, one per thread.
+// It lives next to the TT instead of in it so remembering an eval never evicts a search result,
+// and since only its own thread touches it there is no need for any synchronization.
+// Each entry records the network that computed it : evals of a previous network never hit, and an
+// empty slot (network 0, no network has that id) never matches, not even the key 0
+class EvalCache {
+   public:
+    struct Entry {
+        uint64_t key     = 0;
+        int32_t  eval    = 0;
+        uint32_t network = 0;  // id of the network the eval comes from, 0 for an empty slot
+    };
+
+    bool probe(const uint64_t key, const uint32_t network, int& eval) {
+        const Entry& entry = entries[key & (EVAL_CACHE_SIZE - 1)];
+        probes++;
+
+        if (entry.key != key || entry.network != network || !network)
+        {
+            return false;
+        }
+
+        hits++;
+        eval = entry.eval;
+        return true;
+    }
+
+    void store(const uint64_t key, const uint32_t network, const int eval) {
+        entries[key & (EVAL_CACHE_SIZE - 1)] = {key, eval, network};
+    }
+
+    void prefetch(const uint64_t key) const { __builtin_prefetch(&entries[key & (EVAL_CACHE_SIZE - 1)]); }
+
+    void clear() {
+        for (Entry& entry : entries)
+            entry = Entry();
+
+        hits = probes = 0;
+    }
+
+    uint64_t hits   = 0;
+    uint64_t probes = 0;
+
+   private:
+    Entry entries[EVAL_CACHE_SIZE];
+};
+
+}  // namespace eval
+}  // namespace Shahrazad
@@ -0,0 +1,40 @@
+#pragma once
+
+// Body of the kernels_*.cpp files : each of them defines SIMD_ARCH, includes this header and is compiled
+// with the flags of its level (see the Makefile), the table it builds only points at code of that level
+
+#include "cpu.h"
+#include "simd.h"
+
+#if defined(__BMI__)
+    #include <immintrin.h>
+#endif
+
+
+namespace Shahrazad {
+namespace cpu {
+
+static int popcount(uint64_t bits) { return __builtin_popcountll(bits); }
+
+static int lsb(uint64_t bits) {
+#if defined(__BMI__)
+    return _tzcnt_u64(bits);
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+static constexpr Kernels make_kernels(Level level) {
+    return {level,
+            &nnue::simd::refresh_accumulator,
+            &nnue::simd::update_accumulator,
+            &nnue::simd::update_accumulators,
+            &nnue::simd::clipped_relu_u8,
+            &nnue::simd::affine_u8i8,
+            &nnue::simd::affine_sparse_u8i8,
+            &popcount,
+            &lsb};
+}
+
+}  // namespace cpu
+}  // namespace Shahrazad
@@ -0,0 +1,12 @@
+// Kernels for AVX2 + FMA
+#define SIMD_ARCH avx2
+#include "kernels.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+const Kernels kernels_avx2 = make_kernels(Level::AVX2);
+
+}  // namespace cpu
+}  // namespace Shahrazad
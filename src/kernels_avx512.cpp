@@ -0,0 +1,12 @@
+// Kernels for AVX-512 F/BW
+#define SIMD_ARCH avx512
+#include "kernels.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+const Kernels kernels_avx512 = make_kernels(Level::AVX512);
+
+}  // namespace cpu
+}  // namespace Shahrazad
@@ -0,0 +1,12 @@
+// Kernels for AVX2 + BMI1/BMI2
+#define SIMD_ARCH bmi2
+#include "kernels.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+const Kernels kernels_bmi2 = make_kernels(Level::BMI2);
+
+}  // namespace cpu
+}  // namespace Shahrazad
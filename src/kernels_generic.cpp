@@ -0,0 +1,12 @@
+// Portable kernels, built with the baseline flags of the target
+#define SIMD_ARCH generic
+#include "kernels.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+const Kernels kernels_generic = make_kernels(Level::SCALAR);
+
+}  // namespace cpu
+}  // namespace Shahrazad
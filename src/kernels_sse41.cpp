@@ -0,0 +1,12 @@
+// Kernels for SSE4.1 + POPCNT
+#define SIMD_ARCH sse41
+#include "kernels.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+const Kernels kernels_sse41 = make_kernels(Level::SSE41);
+
+}  // namespace cpu
+}  // namespace Shahrazad
@@ -0,0 +1,12 @@
+// Kernels for AVX-512 with VNNI
+#define SIMD_ARCH vnni
+#include "kernels.h"
+
+
+namespace Shahrazad {
+namespace cpu {
+
+const Kernels kernels_vnni = make_kernels(Level::AVX512VNNI);
+
+}  // namespace cpu
+}  // namespace Shahrazad
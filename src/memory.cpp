@@ -0,0 +1,104 @@
+#include "memory.h"
+
+#include <cstdlib>
+
+#if defined(__unix__) || defined(__APPLE__)
+    #include <sys/mman.h>
+#endif
+
+
+namespace Shahrazad {
+namespace memory {
+
+static std::size_t round_up(std::size_t size, std::size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+Allocation large_alloc(std::size_t size) {
+    Allocation allocation;
+
+#if defined(__linux__)
+    // Only worth it for blocks of at least one huge page, smaller ones would waste most of it
+    if (size >= HUGE_PAGE_SIZE)
+    {
+        const std::size_t rounded = round_up(size, HUGE_PAGE_SIZE);
+
+        // 1. explicit huge pages, only succeeds if the admin reserved some (vm.nr_hugepages)
+        void* ptr = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (ptr != MAP_FAILED)
+        {
+            allocation.ptr  = ptr;
+            allocation.size = rounded;
+            allocation.mode = AllocMode::HUGETLB;
+            return allocation;
+        }
+
+        // 2. 2MB aligned memory and ask the kernel to back it with transparent huge pages
+        ptr = std::aligned_alloc(HUGE_PAGE_SIZE, rounded);
+
+        if (ptr)
+        {
+            allocation.ptr  = ptr;
+            allocation.size = rounded;
+            allocation.mode = madvise(ptr, rounded, MADV_HUGEPAGE) == 0 ? AllocMode::MADVISE : AllocMode::ALIGNED;
+            return allocation;
+        }
+    }
+#endif
+
+    // 3. plain cache line aligned memory
+    const std::size_t rounded = round_up(size ? size : 1, CACHE_LINE);
+    void*             ptr     = std::aligned_alloc(CACHE_LINE, rounded);
+
+    if (!ptr)
+    {
+        throw std::bad_alloc();
+    }
+
+    allocation.ptr  = ptr;
+    allocation.size = rounded;
+    allocation.mode = AllocMode::ALIGNED;
+    return allocation;
+}
+
+void large_free(Allocation& allocation) {
+    if (!allocation.ptr)
+    {
+        return;
+    }
+
+#if defined(__unix__) || defined(__APPLE__)
+    if (allocation.mode == AllocMode::HUGETLB || allocation.mode == AllocMode::MAPPED)
+    {
+        munmap(allocation.ptr, allocation.size);
+    }
+    else
+    {
+        std::free(allocation.ptr);
+    }
+#else
+    std::free(allocation.ptr);
+#endif
+
+    allocation = Allocation();
+}
+
+const char* mode_name(AllocMode mode) {
+    switch (mode)
+    {
+    case AllocMode::HUGETLB :
+        return "hugetlb";
+    case AllocMode::MADVISE :
+        return "madvise";
+    case AllocMode::ALIGNED :
+        return "aligned";
+    case AllocMode::MAPPED :
+        return "mapped";
+    default :
+        return "none";
+    }
+}
+
+}  // namespace memory
+}  // namespace Shahrazad
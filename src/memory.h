@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <utility>
+
+
+namespace Shahrazad {
+namespace memory {
+
+constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+constexpr std::size_t CACHE_LINE     = 64;
+
+// how a large block ended up being allocated
+enum class AllocMode : int {
+    NONE,
+    HUGETLB,  // explicit huge pages (mmap with MAP_HUGETLB)
+    MADVISE,  // 2MB aligned memory with transparent huge pages requested
+    ALIGNED,  // plain cache line aligned memory
+    MAPPED    // a mapping of a file or shared memory object owned by someone else, only unmapped
+};
+
+// a block returned by large_alloc, it has to be handed back to large_free as is
+struct Allocation {
+    void*       ptr  = nullptr;
+    std::size_t size = 0;
+    AllocMode   mode = AllocMode::NONE;
+};
+
+// tries explicit huge pages, then transparent huge pages, then aligned memory
+Allocation  large_alloc(std::size_t size);
+void        large_free(Allocation& allocation);
+const char* mode_name(AllocMode mode);
+
+// owning pointer to a single object living in a large allocation
+template<typename T>
+class LargePtr {
+   public:
+    LargePtr() = default;
+
+    explicit LargePtr(const Allocation& allocation) :
+        allocation(allocation) {}
+
+    LargePtr(const LargePtr&)            = delete;
+    LargePtr& operator=(const LargePtr&) = delete;
+
+    LargePtr(LargePtr&& other) noexcept :
+        allocation(std::exchange(other.allocation, Allocation())) {}
+
+    LargePtr& operator=(LargePtr&& other) noexcept {
+        if (this != &other)
+        {
+            reset();
+            allocation = std::exchange(other.allocation, Allocation());
+        }
+
+        return *this;
+    }
+
+    ~LargePtr() { reset(); }
+
+    void reset() {
+        if (allocation.ptr)
+        {
+            get()->~T();
+            large_free(allocation);
+        }
+    }
+
+    T*        get() const { return static_cast<T*>(allocation.ptr); }
+    T*        operator->() const { return get(); }
+    T&        operator*() const { return *get(); }
+    AllocMode mode() const { return allocation.mode; }
+
+   private:
+    Allocation allocation;
+};
+
+template<typename T>
+LargePtr<T> make_large() {
+    Allocation allocation = large_alloc(sizeof(T));
+    new (allocation.ptr) T();
+    return LargePtr<T>(allocation);
+}
+
+}  // namespace memory
+}  // namespace Shahrazad
@@ -1,4 +1,5 @@
 #include "move.h"
+#include "accumulator.h"
 #include "nnue.h"
 #include "position.h"
 #include "error.h"
@@ -11,7 +12,10 @@ namespace Shahrazad {
 namespace movegen {
 
 // make a move in a given position
-void do_move(position::Position& pos, const types::Move& move) {
+void do_move(position::Position& pos, const types::Move& move) { do_move(pos, move, pos.key_after(move)); }
+
+// make a move whose resulting key 'next_key' (pos.key_after(move)) the caller already has
+void do_move(position::Position& pos, const types::Move& move, const uint64_t next_key) {
     // data about the given move and position
     types::Square    from   = types::Square(move.getFrom());
     types::Square    to     = types::Square(move.getTo());
@@ -39,6 +43,17 @@ void do_move(position::Position& pos, const types::Move& move) {
         throw Shahrazad::error::Position_error("Invalid color");
     }
 
+    // the pieces this move changes, the NNUE accumulator is only updated from them once it's needed
+    nnue::DirtyPieces      dirty;
+    const types::PieceType captured = pos.pieceOn(to);
+
+    dirty.add(piece, _color, from, to);
+
+    if (captured != types::PieceType::NOPE)
+    {
+        dirty.add(captured, types::Color(static_cast<int>(_color) ^ 1), to, types::Square::NONE);
+    }
+
     // store the current position as the previous position of the next one after commiting a move
     position::Position previous_position = pos;
     pos.pieces[(int) (from)]             = types::PieceType::NOPE;
@@ -58,6 +73,7 @@ void do_move(position::Position& pos, const types::Move& move) {
     pos.switch_side();
     // add the position to the list of played positions
     pos.played_positions.push_back(pos.position_key);
+    pos.position_key = next_key;
     // increment the stack history
     pos.stacked_his++;
 
@@ -99,18 +115,9 @@ void do_move(position::Position& pos, const types::Move& move) {
         break;
     }
 
-    // update or refresh the NNUE accumalator caches
-    for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+    if (pos.accumulators)
     {
-        if (pos.needs_refresh[static_cast<int>(perspective)])
-        {
-            nnue::nnue.refresh_accumulator(nnue::nnue.l_0, nnue::get_active_features(pos, perspective), perspective);
-        }
-        else
-        {
-            nnue::nnue.update_accumulator(nnue::nnue.l_0, nnue::get_removed_features(pos, *pos.prev, perspective),
-                                          nnue::get_added_features(pos, *pos.prev, perspective), perspective);
-        }
+        pos.accumulators->push(dirty);
     }
 }
 
@@ -31,6 +31,7 @@ struct MoveList {
 enum PickerType : uint8_t { SEARCH, QSEARCH };
 
 void                     do_move(position::Position& pos, const types::Move& move);
+void                     do_move(position::Position& pos, const types::Move& move, uint64_t next_key);
 std::vector<types::Move> king_moves(const types::Square square, types::Color color, const position::Position& pos);
 std::vector<types::Move> pawn_moves(const types::Square square, types::Color color, const position::Position& pos);
 std::vector<types::Move> rook_moves(const types::Square square, types::Color color, const position::Position& pos);
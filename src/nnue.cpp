@@ -1,10 +1,20 @@
 #include "nnue.h"
+#include "cpu.h"
 #include "position.h"
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
 #include <math.h>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 
 namespace Shahrazad {
 namespace nnue {
@@ -15,105 +25,49 @@ namespace nnue {
     this project it would be great!
 */
 
-// Computes a unique key for a feature based on the position of the king, the type of piece, its square, and
-// its color.
-uint32_t feature_key(types::Square king_square, types::PieceType piece_type, types::Square square, types::Color color) {
-    // Calculate the index for the piece based on its type and color
-    int p_idx = static_cast<int>(piece_type) * 2 + static_cast<int>(color);
-
-    // Compute the key by combining the piece's position, king's square, and other characteristics
-    return (static_cast<int>(square) + (p_idx + static_cast<int>(king_square) * 10)) * 64;
-}
-
-// Retrieves a vector of active feature keys for the given position and color.
-// Features represent active pieces on the board.
-std::vector<uint32_t> get_active_features(const position::Position& pos, types::Color color) {
-    std::vector<uint32_t> active_features;
+NNue nnue;
 
-    // Get the occupancy bitboard for the given color (either white or black)
-    board::Bitboard occupancy = color == types::Color::WHITE ? pos._white_occupancy() : pos._black_occupancy();
+// Retrieves the active features of 'perspective' for the given position.
+// Features represent active pieces on the board, of both colors.
+FeatureList get_active_features(const NNue& network, const position::Position& pos, types::Color perspective) {
+    FeatureList         active_features;
+    const types::Square king = pos.king_square(perspective);
 
-    // Loop through all squares on the board (64 squares)
-    for (unsigned int sq = 0; sq < 64; sq++)
+    for (auto color : {types::Color::WHITE, types::Color::BLACK})
     {
-        // Skip if no piece is present on the current square
-        if (!occupancy.is_bitset(sq))
-        {
-            continue;
-        }
-
-        // Generate the feature key for the piece on the current square
-        uint32_t key = feature_key(pos.king_square(color), pos.pieceOn(sq), types::Square(sq), color);
-        active_features.push_back(key);
-    }
-
-    // Return a list of active feature keys
-    return active_features;
-}
-
-// Retrieves a list of added features between the current and previous positions for a given color.
-// These are features that exist in the current position but were not present in the previous one.
-std::vector<uint32_t> get_added_features(const position::Position& cur_pos, const position::Position& prev_pos,
-                                         types::Color color) {
-    // Get the active features in the current and previous positions
-    std::vector<uint32_t> active_features = get_active_features(cur_pos, color);
-    std::vector<uint32_t> prev_features   = get_active_features(prev_pos, color);
-    const int             size            = active_features.size();
-
-    std::vector<uint32_t> result;
+        // Get the occupancy bitboard for the color (either white or black)
+        uint64_t occupancy = (color == types::Color::WHITE ? pos._white_occupancy() : pos._black_occupancy()).board();
 
-    // Find features that exist in the current position but not in the previous position
-    for (int i = 0; i < size; i++)
-    {
-        if (std::find(prev_features.begin(), prev_features.end(), active_features[i]) == prev_features.end())
+        // Visit only the occupied squares
+        while (occupancy)
         {
-            result.push_back(active_features[i]);
-        }
-    }
+            const int sq = __builtin_ctzll(occupancy);
+            occupancy &= occupancy - 1;
 
-    // Return the list of added features
-    return result;
-}
-
-// Retrieves a list of removed features between the current and previous positions for a given color.
-// These are features that existed in the previous position but are no longer present in the current one.
-std::vector<uint32_t> get_removed_features(const position::Position& cur_pos, const position::Position& prev_pos,
-                                           types::Color color) {
-    // Get the active features in the current and previous positions
-    std::vector<uint32_t> active_features = get_active_features(cur_pos, color);
-    std::vector<uint32_t> prev_features   = get_active_features(prev_pos, color);
-    const std::size_t     size            = prev_features.size();
-    std::vector<uint32_t> result;
-
-    // Find features that existed in the previous position but no longer exist in the current one
-    for (int i = 0; i < size; i++)
-    {
-        if (std::find(active_features.begin(), active_features.end(), prev_features[i]) == active_features.end())
-        {
-            result.push_back(prev_features[i]);
+            active_features.push_back(network.feature(perspective, king, pos.pieceOn(sq), types::Square(sq), color));
         }
     }
 
-    // Return the list of removed features
-    return result;
+    // Return a list of active features
+    return active_features;
 }
 
 // Returns the weights for a given index in the linear layer.
 int16_t* LinearLayer::getWeights(const int index) const {
     // Ensure that the index is valid
-    assert(index >= 0 && index < static_cast<int>(weights_dimensions[0]));
+    assert(index >= 0 && index < output_dims);
     // Return the weights for the specified index
-    return weights[index];
+    return weights + index * row_stride;
 }
 
 // Returns the number of output dimensions (neurons) in the linear layer.
-int LinearLayer::get_num_outputs() const { return outputs.size(); }
+int LinearLayer::get_num_outputs() const { return output_dims; }
 
 // Returns the number of input dimensions (neurons) in the linear layer.
-int LinearLayer::get_num_inputs() const { return inputs.size(); }
+int LinearLayer::get_num_inputs() const { return input_dims; }
 
 // Returns the biases for the output neurons in the linear layer.
-std::vector<int16_t> LinearLayer::getBias() const { return biases; }
+const int16_t* LinearLayer::getBias() const { return biases; }
 
 // Constructor for the LinearLayer class.
 // Initializes the layer with random weights and biases based on the input and output sizes.
@@ -123,21 +77,50 @@ LinearLayer::LinearLayer(int input_size, int output_size, double lr) {
     assert(output_size > 0);
 
     // Set the dimensions and learning rate (eta)
-    output_dims           = output_size;
-    input_dims            = input_size;
-    eta                   = lr;
-    weights_dimensions[0] = output_size;
-    weights_dimensions[1] = input_size;
+    output_dims = output_size;
+    input_dims  = input_size;
+    eta         = lr;
+
+    // All the rows and the biases live in one large (huge page backed when possible) block, each row
+    // keeps one extra value for the bias used while training and is padded to a whole cache line
+    constexpr std::size_t line = memory::CACHE_LINE / sizeof(int16_t);
+
+    row_stride    = (input_size + 1 + line - 1) / line * line;
+    weights_block = memory::large_alloc((output_size * row_stride + input_size) * sizeof(int16_t));
+    weights       = static_cast<int16_t*>(weights_block.ptr);
+
+    int16_t* bias_data = weights + output_size * row_stride;
+
+    for (int i = 0; i < input_size; i++)
+        bias_data[i] = 0;
+
+    biases = bias_data;
 
     // Initialize the weights and biases randomly for each output neuron
     for (int i = 0; i < output_size; i++)
     {
         // Initialize the weights for each input, including an extra one for bias
         for (int j = 0; j <= input_size; j++)
-            weights[i][j] = (float) rand() / RAND_MAX;
+            getWeights(i)[j] = (float) rand() / RAND_MAX;
     }
 }
 
+// Releases the weight rows and their backing block
+LinearLayer::~LinearLayer() { memory::large_free(weights_block); }
+
+// Points the layer at weights owned by someone else, its own block (if any) is released.
+// They are read only (a mapped file or the executable), only the training code writes weights and it
+// works on layers that allocated their own
+void LinearLayer::attach(const int16_t* weights_data, const int16_t* bias_data, int num_rows, int row_size) {
+    memory::large_free(weights_block);
+
+    input_dims  = row_size;
+    output_dims = num_rows;
+    row_stride  = row_size;
+    weights     = const_cast<int16_t*>(weights_data);
+    biases      = bias_data;
+}
+
 // Feed-forward pass for the linear layer in a neural network.
 // Takes the input vector and produces an output vector based on weights and biases.
 std::vector<int16_t> LinearLayer::feedForward(const std::vector<int16_t>& input) {
@@ -155,10 +138,10 @@ std::vector<int16_t> LinearLayer::feedForward(const std::vector<int16_t>& input)
 
         // For each output neuron, calculate the weighted sum of inputs
         for (int w = 0; w < input_dims; w++)
-            sum += weights[i][w] * input[w];
+            sum += getWeights(i)[w] * input[w];
 
         // Add the bias term to the weighted sum
-        sum += weights[i][input_dims];
+        sum += getWeights(i)[input_dims];
 
         // Store the result in the output vector
         outputs.push_back(sum);
@@ -184,7 +167,7 @@ std::vector<int16_t> LinearLayer::backPropagate(const std::vector<int16_t>& grad
 
         // Sum up the gradients coming from each output neuron, weighted by the connection
         for (int j = 0; j < output_dims; j++)
-            g += grad[j] * weights[j][i];
+            g += grad[j] * getWeights(j)[i];
 
         // Store the gradient for this neuron in the previous layer
         prev_layer_grad.push_back(g);
@@ -195,148 +178,351 @@ std::vector<int16_t> LinearLayer::backPropagate(const std::vector<int16_t>& grad
     {
         for (int j = 0; j < input_dims; j++)
             // Update each weight by subtracting a scaled version of the gradient
-            weights[i][j] -= (eta * grad[i] * inputs[j]);
+            getWeights(i)[j] -= (eta * grad[i] * inputs[j]);
 
         // Update the bias for each output neuron
-        weights[i][input_dims] -= eta * grad[i];
+        getWeights(i)[input_dims] -= eta * grad[i];
     }
 
     // Return the gradient for the previous layer
     return prev_layer_grad;
 }
 
-// A specialized linear function for passing data through a layer in the NNue neural network model.
-std::vector<int16_t> NNue::linear(const LinearLayer& layer, std::vector<int16_t>& output,
-                                  const std::vector<int16_t>& input) const {
-    // Initialize the output vector by setting each value to the corresponding bias for the layer
-    for (int i = 0; i < layer.get_num_outputs(); i++)
-        output[i] = layer.getBias()[i];
+// Constructor for the AffineLayer class, weights and biases share one cache line aligned block
+AffineLayer::AffineLayer(int input_size, int output_size, bool sparse_input) {
+    assert(input_size > 0);
+    assert(output_size > 0);
+    assert(!sparse_input || input_size % 4 == 0);
+
+    num_inputs  = input_size;
+    num_outputs = output_size;
+    sparse      = sparse_input;
 
-    // Compute the weighted sum of inputs for each output neuron
-    for (int i = 0; i < layer.get_num_inputs(); i++)
+    const std::size_t weights_size = memory::CACHE_LINE * ((input_size * output_size + 63) / 64);
+    block                          = memory::large_alloc(weights_size + output_size * sizeof(int32_t));
+    weights                        = static_cast<const int8_t*>(block.ptr);
+    biases                         = reinterpret_cast<const int32_t*>(weights + weights_size);
+
+    std::memset(block.ptr, 0, weights_size + output_size * sizeof(int32_t));
+}
+
+AffineLayer::~AffineLayer() { memory::large_free(block); }
+
+void AffineLayer::attach(const int8_t* weights_data, const int32_t* bias_data) {
+    memory::large_free(block);
+
+    weights = weights_data;
+    biases  = bias_data;
+}
+
+void AffineLayer::propagate(const uint8_t* input, int32_t* output) const {
+    // after the clipped ReLU most of the transformed features are zero, only the others are read
+    if (sparse)
+    {
+        cpu::kernels().affine_sparse_u8i8(input, weights, biases, output, num_inputs, num_outputs);
+        return;
+    }
+
+    // the kernels work on blocks of 64 inputs and 4 outputs, the small output layer is done here
+    if (num_inputs % 64 == 0 && num_outputs % 4 == 0)
+    {
+        cpu::kernels().affine_u8i8(input, weights, biases, output, num_inputs, num_outputs);
+        return;
+    }
+
+    for (int j = 0; j < num_outputs; j++)
     {
-        for (int j = 0; j < layer.get_num_outputs(); ++j)
-            // Multiply the input by the weight and add it to the corresponding output neuron
-            output[j] += input[i] * layer.getWeights(i)[j];
+        const int8_t* row = getWeights(j);
+        int32_t       sum = biases[j];
+
+        for (int i = 0; i < num_inputs; i++)
+            sum += input[i] * row[i];
+
+        output[j] = sum;
     }
+}
+
+int32_t AffineLayer::propagate_one(const uint8_t* input, int output) const {
+    assert(output >= 0 && output < num_outputs);
+
+    const int8_t* row = getWeights(output);
+    int32_t       sum = biases[output];
 
-    // Return the resulting output vector
-    return output;
+    for (int i = 0; i < num_inputs; i++)
+        sum += input[i] * row[i];
+
+    return sum;
+}
+
+int NNue::output_bucket(const position::Position& pos) {
+    const int pieces = cpu::kernels().popcount(pos._white_occupancy().board() | pos._black_occupancy().board());
+    return std::min((pieces - 1) / 4, NUM_OUTPUTS - 1);
 }
 
+// NNUE evaluation function to compute the score of the position, in centipawns for the side to move
+int NNue::nnue_eval(const position::Position& pos, const NNue::Accumulator<size>& accumulator) const {
+    const types::Color us   = pos.getSide();
+    const types::Color them = types::Color(static_cast<int>(us) ^ 1);
+
+    alignas(64) uint8_t transformed[2 * size];
+    alignas(64) int32_t hidden_sums[L2_SIZE];
+    alignas(64) uint8_t hidden[L2_SIZE];
+
+    // Both perspectives of the accumulator through the clipped ReLU, side to move first
+    cpu::kernels().clipped_relu_u8(accumulator[us], transformed, size);
+    cpu::kernels().clipped_relu_u8(accumulator[them], transformed + size, size);
+
+    // Hidden layer, its sums are scaled back to the activation range before the next clipped ReLU
+    l_1.propagate(transformed, hidden_sums);
+
+    for (int i = 0; i < L2_SIZE; i++)
+        hidden[i] = std::clamp(hidden_sums[i] >> WEIGHT_SHIFT, 0, ACTIVATION_MAX);
+
+    // Output layer, only the bucket of this position is computed
+    return l_2.propagate_one(hidden, output_bucket(pos)) / OUTPUT_SCALE;
+}
+
+void NNue::evaluate_batch(const position::Position* positions, int n, int* out, int threads) const {
+    assert(id() && "evaluate_batch needs a loaded network");
+
+    if (threads <= 0)
+    {
+        threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+
+    threads = std::min(threads, std::max(1, n / BATCH_MIN_PER_THREAD));
+
+    // each share is evaluated one position after the other, every accumulator built from scratch
+    auto evaluate_range = [this, positions, out](int begin, int end) {
+        Accumulator<size> accumulator;
 
-// Applies clipped ReLU to the input: ensures values are between 0 and 1
-std::vector<int16_t> NNue::clipped_relu(std::vector<int16_t> output, const std::vector<int16_t> input) const {
-    std::size_t size = input.size();
+        for (int i = begin; i < end; i++)
+        {
+            for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+                cpu::kernels().refresh_accumulator(l_0, accumulator,
+                                                   get_active_features(*this, positions[i], perspective), perspective);
 
-    // Apply ReLU with values clipped between 0 and 1
-    for (int i = 0; i < size; i++)
+            out[i] = nnue_eval(positions[i], accumulator);
+        }
+    };
+
+    if (threads == 1)
     {
-        output[i] = std::min(std::max(input[i], int16_t(0)), int16_t(1));
+        evaluate_range(0, n);
+        return;
     }
 
-    return output;
+    // contiguous shares, the network is only read so the threads share it as it is
+    std::vector<std::thread> workers;
+    const int                share = (n + threads - 1) / threads;
+
+    for (int begin = 0; begin < n; begin += share)
+        workers.emplace_back(evaluate_range, begin, std::min(n, begin + share));
+
+    for (std::thread& worker : workers)
+        worker.join();
 }
 
-// NNUE evaluation function to compute the score of the position
-float NNue::nnue_eval(const position::Position& pos, NNue::Accumulator<size>& caches) const {
-    types::Color color = pos.getSide();  // Get the side to move
+// Byte offsets of the sections of a network file, each one starts on a cache line
+struct NetLayout {
+    std::size_t ft_biases;
+    std::size_t ft_weights;
+    std::size_t hidden_biases;
+    std::size_t hidden_weights;
+    std::size_t output_biases;
+    std::size_t output_weights;
+    std::size_t total;
+};
+
+static NetLayout net_layout(int num_king_buckets) {
+    NetLayout   layout;
+    std::size_t offset = sizeof(NetFileHeader);
+
+    auto section = [&offset](std::size_t bytes) {
+        const std::size_t start = offset;
+        offset += (bytes + memory::CACHE_LINE - 1) / memory::CACHE_LINE * memory::CACHE_LINE;
+        return start;
+    };
+
+    layout.ft_biases      = section(size * sizeof(int16_t));
+    layout.ft_weights =
+      section(static_cast<std::size_t>(num_king_buckets) * FEATURES_PER_BUCKET * size * sizeof(int16_t));
+    layout.hidden_biases  = section(L2_SIZE * sizeof(int32_t));
+    layout.hidden_weights = section(L2_SIZE * 2 * size * sizeof(int8_t));
+    layout.output_biases  = section(NUM_OUTPUTS * sizeof(int32_t));
+    layout.output_weights = section(NUM_OUTPUTS * L2_SIZE * sizeof(int8_t));
+    layout.total          = offset;
+
+    return layout;
+}
 
-    std::vector<int16_t> buffer;
-    int16_t              input[2 * MAX_INPUT_SIZE];  // Input buffer for both sides
+// FNV-1a over 64-bit words, the sections are padded to cache lines so their size is always a multiple of 8
+static uint64_t net_checksum(const char* data, std::size_t bytes) {
+    uint64_t hash = 14695981039346656037ull;
 
-    // Copy features for both sides (current side and opponent) into the input array
-    for (int i = 0; i < MAX_INPUT_SIZE; i++)
+    for (std::size_t i = 0; i + 8 <= bytes; i += 8)
     {
-        input[i]                  = caches[color][i];
-        input[MAX_INPUT_SIZE + i] = caches[types::Color(static_cast<int>(color) ^ 1)][i];
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
     }
 
-    std::vector<int16_t> current_output = buffer;
-    std::vector<int16_t> current_input;
+    return hash;
+}
 
-    // Load input into current_input
-    for (int i = 0; i < MAX_INPUT_SIZE; i++)
-        current_input[i] = input[i];
+// The default network, placed in the executable by embedded_net.cpp (empty when the build had none)
+extern "C" const char shz_embedded_net[];
+extern "C" const char shz_embedded_net_end[];
 
-    std::vector<int16_t> next_output;
+NNue::~NNue() { memory::large_free(mapping); }
 
-    // Apply first clipped ReLU activation
-    next_output    = clipped_relu(current_output, current_input);
-    current_input  = current_output;
-    current_output = next_output;
+bool NNue::use_network(const char* data, const std::size_t bytes) {
+    if (bytes < sizeof(NetFileHeader) || reinterpret_cast<uintptr_t>(data) % memory::CACHE_LINE)
+    {
+        return false;
+    }
 
-    // Apply first linear layer
-    next_output    = linear(l_1, current_output, current_input);
-    current_input  = current_output;
-    current_output = next_output;
+    // the header says how many king buckets the network has, which sets the size of everything after it
+    const NetFileHeader* header  = reinterpret_cast<const NetFileHeader*>(data);
+    const int            buckets = header->num_king_buckets;
 
-    // Apply second clipped ReLU activation
-    next_output    = clipped_relu(current_output, current_input);
-    current_input  = current_output;
-    current_output = next_output;
+    if (buckets < 1 || buckets > MAX_KING_BUCKETS
+        || std::any_of(header->king_buckets, header->king_buckets + 32, [=](uint8_t b) { return b >= buckets; }))
+    {
+        return false;
+    }
 
-    // Apply second linear layer (final output)
-    next_output = linear(l_2, current_output, current_input);
+    const NetLayout layout = net_layout(buckets);
+    const bool valid = bytes == layout.total && std::memcmp(header->magic, NET_FILE_MAGIC, sizeof(header->magic)) == 0
+                    && header->version == NET_FILE_VERSION && header->arch_hash == architecture_hash()
+                    && header->num_features == static_cast<uint32_t>(buckets * FEATURES_PER_BUCKET)
+                    && header->ft_size == size && header->hidden_size == L2_SIZE
+                    && header->output_size == NUM_OUTPUTS && header->ft_scale == FT_SCALE
+                    && header->weight_shift == WEIGHT_SHIFT && header->output_scale == OUTPUT_SCALE
+                    && header->checksum
+                         == net_checksum(data + sizeof(NetFileHeader), layout.total - sizeof(NetFileHeader));
+
+    if (!valid)
+    {
+        return false;
+    }
+
+    num_king_buckets = buckets;
+    std::copy(header->king_buckets, header->king_buckets + 32, king_buckets.begin());
+
+    l_0.attach(reinterpret_cast<const int16_t*>(data + layout.ft_weights),
+               reinterpret_cast<const int16_t*>(data + layout.ft_biases), num_features(), size);
+    l_1.attach(reinterpret_cast<const int8_t*>(data + layout.hidden_weights),
+               reinterpret_cast<const int32_t*>(data + layout.hidden_biases));
+    l_2.attach(reinterpret_cast<const int8_t*>(data + layout.output_weights),
+               reinterpret_cast<const int32_t*>(data + layout.output_biases));
 
-    // Return the final evaluation score
-    return current_output[0];
+    // networks are only loaded between searches, a plain counter is enough
+    static uint32_t networks_loaded = 0;
+    network_id                      = ++networks_loaded;
+
+    return true;
 }
 
-// Refresh accumulator by resetting it and updating with active features
-void NNue::refresh_accumulator(const LinearLayer& layer, const std::vector<uint32_t>& active_features,
-                               types::Color perspective) {
-    assert(perspective == types::Color::WHITE || perspective == types::Color::BLACK);
+bool NNue::load(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
 
-    // Reset the cache with the layer's biases for the current side
-    for (int i = 0; i < size; ++i)
+    if (fd < 0)
     {
-        caches[perspective][i] = layer.getBias()[i];
+        return false;
     }
 
-    // Add contributions from each active feature
-    for (uint32_t a : active_features)
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(NetFileHeader))
     {
-        for (int i = 0; i < size; ++i)
-        {
-            caches[perspective][i] += layer.getWeights(a)[i];
-        }
+        close(fd);
+        return false;
     }
-}
 
-// Update the accumulator by removing old features and adding new ones
-void NNue::update_accumulator(const LinearLayer& layer, const std::vector<uint32_t>& removed_features,
-                              const std::vector<uint32_t>& added_features, types::Color perspective) {
-    NNue::Accumulator<size> new_acc = caches;
+    // the pages of a read only mapping stay shared with every other process that mapped the same file
+    const std::size_t bytes  = st.st_size;
+    void*             mapped = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
 
-    assert(perspective == types::Color::WHITE || perspective == types::Color::BLACK);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
 
-    // Initialize the accumulator with the current cache
-    for (int i = 0; i < size; ++i)
+    if (!use_network(static_cast<const char*>(mapped), bytes))
     {
-        new_acc[perspective][i] = caches[perspective][i];
+        munmap(mapped, bytes);
+        return false;
     }
 
-    // Subtract weights of removed features
-    for (uint32_t r : removed_features)
+    // the previous network (if any) is only released once nothing points at it anymore
+    memory::large_free(mapping);
+    mapping.ptr  = mapped;
+    mapping.size = bytes;
+    mapping.mode = memory::AllocMode::MAPPED;
+
+    return true;
+}
+
+bool NNue::load_embedded() {
+    if (!use_network(shz_embedded_net, shz_embedded_net_end - shz_embedded_net))
     {
-        for (int i = 0; i < size; ++i)
-        {
-            new_acc[perspective][i] -= layer.getWeights(r)[i];
-        }
+        return false;
     }
 
-    // Add weights of new added features
-    for (uint32_t a : added_features)
+    memory::large_free(mapping);
+    return true;
+}
+
+bool init_network(const std::string& eval_file) {
+    if (eval_file.empty() || eval_file == EMBEDDED_NET_NAME)
     {
-        for (int i = 0; i < size; ++i)
-        {
-            new_acc[perspective][i] += layer.getWeights(a)[i];
-        }
+        return nnue.load_embedded();
+    }
+
+    return nnue.load(eval_file);
+}
+
+bool NNue::save(const std::string& path) const {
+    // without a loaded network the layers point at nothing
+    if (!id())
+    {
+        return false;
     }
 
-    // Update the cache with the new accumulator
-    caches = new_acc;
+    const NetLayout   layout = net_layout(num_king_buckets);
+    std::vector<char> data(layout.total, 0);
+
+    for (int f = 0; f < num_features(); f++)
+        std::memcpy(&data[layout.ft_weights + f * size * sizeof(int16_t)], l_0.getWeights(f), size * sizeof(int16_t));
+
+    std::memcpy(&data[layout.ft_biases], l_0.getBias(), size * sizeof(int16_t));
+    std::memcpy(&data[layout.hidden_biases], l_1.getBias(), L2_SIZE * sizeof(int32_t));
+    std::memcpy(&data[layout.hidden_weights], l_1.weight_data(), L2_SIZE * 2 * size * sizeof(int8_t));
+    std::memcpy(&data[layout.output_biases], l_2.getBias(), NUM_OUTPUTS * sizeof(int32_t));
+    std::memcpy(&data[layout.output_weights], l_2.weight_data(), NUM_OUTPUTS * L2_SIZE * sizeof(int8_t));
+
+    NetFileHeader header = {};
+    std::memcpy(header.magic, NET_FILE_MAGIC, sizeof(header.magic));
+    std::copy(king_buckets.begin(), king_buckets.end(), header.king_buckets);
+    header.version          = NET_FILE_VERSION;
+    header.arch_hash        = architecture_hash();
+    header.num_features     = num_features();
+    header.ft_size          = size;
+    header.hidden_size      = L2_SIZE;
+    header.output_size      = NUM_OUTPUTS;
+    header.ft_scale         = FT_SCALE;
+    header.weight_shift     = WEIGHT_SHIFT;
+    header.output_scale     = OUTPUT_SCALE;
+    header.num_king_buckets = num_king_buckets;
+    header.checksum         = net_checksum(&data[sizeof(NetFileHeader)], layout.total - sizeof(NetFileHeader));
+    std::memcpy(data.data(), &header, sizeof(header));
+
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(data.data(), data.size());
+
+    return static_cast<bool>(file);
 }
 
 }  // namespace nnue
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "bitboard.h"
+#include "memory.h"
 #include "position.h"
 #include "types.h"
+#include <array>
 #include <cassert>
+#include <string>
 #include <vector>
 
 
@@ -12,35 +15,180 @@ namespace nnue {
 
 const std::size_t size = 768;
 
+// Feature indices of one perspective, kept on the stack : building one never allocates.
+// 32 covers every piece on the board
+struct FeatureList {
+    static constexpr int CAPACITY = 32;
 
+    uint32_t values[CAPACITY];
+    int      count = 0;
+
+    void push_back(const uint32_t feature) {
+        assert(count < CAPACITY);
+        values[count++] = feature;
+    }
+
+    int             size() const { return count; }
+    const uint32_t* begin() const { return values; }
+    const uint32_t* end() const { return values + count; }
+};
+
+
+// int16 layer, used as the feature transformer. Its weights are one 64 byte aligned block in row major
+// order, a row being the 'input_dims' values of one output (one feature for the transformer), padded so
+// every row starts on a cache line and is a single aligned stream for the accumulator kernels
 class LinearLayer {
    private:
-    int16_t** weights;
-    uint32_t  weights_dimensions[2];
+    int16_t*           weights = nullptr;
+    memory::Allocation weights_block;  // backing storage of the weights and biases, unless attached
+    std::size_t        row_stride = 0;  // int16 values from one row to the next
 
     std::vector<int16_t> outputs;
     std::vector<int16_t> inputs;
-    std::vector<int16_t> biases;
+    const int16_t*       biases = nullptr;
 
-    int    output_dims;
-    int    input_dims;
+    int    output_dims = 0;
+    int    input_dims  = 0;
     double eta;
 
    public:
     LinearLayer() {}
     LinearLayer(int input_size, int output_size, double lr = 0.01);
+    ~LinearLayer();
+
+    LinearLayer(const LinearLayer&)            = delete;
+    LinearLayer& operator=(const LinearLayer&) = delete;
+
+    int            get_num_outputs() const;
+    int            get_num_inputs() const;
+    int16_t*       getWeights(const int index) const;
+    const int16_t* getBias() const;
 
-    int get_num_outputs() const;
-    int get_num_inputs() const;
-    int16_t* getWeights(const int index) const;
-    std::vector<int16_t> getBias() const;
+    // points the layer at 'num_rows' contiguous rows of 'row_size' weights and at its biases, all owned by the
+    // caller. The kernels use aligned loads : both have to start on a cache line, and so does every row
+    void                 attach(const int16_t* weights_data, const int16_t* bias_data, int num_rows, int row_size);
     std::vector<int16_t> feedForward(const std::vector<int16_t>& input);
     std::vector<int16_t> backPropagate(const std::vector<int16_t>& grad);
 };
 
 const int MAX_INPUT_SIZE = 768;
-const int L1_SIZE        = 1024;
-const int NUM_OUTPUTS    = 8;
+const int L2_SIZE        = 32;
+const int NUM_OUTPUTS    = 8;  // output buckets, by number of pieces on the board
+
+// evaluate_batch : enough positions for a thread of its own
+constexpr int BATCH_MIN_PER_THREAD = 1024;
+
+// Quantization, every parameter is a fixed point integer with a scale set by the trainer :
+//  - feature transformer : int16 weights and biases scaled by FT_SCALE, so FT_SCALE in the accumulator is 1.0
+//  - clipped ReLU : [0, 1.0] becomes [0, ACTIVATION_MAX] packed into uint8
+//  - hidden layers : int8 weights scaled by WEIGHT_SCALE and int32 biases scaled by FT_SCALE * WEIGHT_SCALE,
+//    the int32 sums are shifted right by WEIGHT_SHIFT to get back to the activation scale
+//  - output : the int32 sum of the last layer divided by OUTPUT_SCALE is the evaluation in centipawns
+constexpr int ACTIVATION_MAX = 127;
+constexpr int FT_SCALE       = 127;
+constexpr int WEIGHT_SHIFT   = 6;
+constexpr int WEIGHT_SCALE   = 1 << WEIGHT_SHIFT;
+constexpr int OUTPUT_SCALE   = 16;
+
+// int8 hidden layer of the quantized network. The weights are stored output after output, unless the
+// layer takes sparse inputs : then they are in blocks of 4 inputs, the 4 weights of every output for
+// inputs 0-3, then for inputs 4-7 and so on, so the groups of 4 zero inputs can be skipped
+class AffineLayer {
+   private:
+    const int8_t*      weights = nullptr;
+    const int32_t*     biases  = nullptr;
+    memory::Allocation block;  // backing storage of the weights and biases
+
+    int  num_inputs;
+    int  num_outputs;
+    bool sparse;
+
+   public:
+    AffineLayer(int input_size, int output_size, bool sparse_input = false);
+    ~AffineLayer();
+
+    AffineLayer(const AffineLayer&)            = delete;
+    AffineLayer& operator=(const AffineLayer&) = delete;
+
+    int            get_num_outputs() const { return num_outputs; }
+    int            get_num_inputs() const { return num_inputs; }
+    const int8_t*  getWeights(const int output) const {
+        assert(!sparse);
+        return weights + output * num_inputs;
+    }
+    const int8_t*  weight_data() const { return weights; }  // every weight, in the layout of the layer
+    const int32_t* getBias() const { return biases; }
+
+    // uses weights and biases owned by the caller instead of its own block
+    void attach(const int8_t* weights_data, const int32_t* bias_data);
+
+    // int32 sums of the uint8 activations with the weights, biases included
+    void propagate(const uint8_t* input, int32_t* output) const;
+
+    // the sum of a single output, the others are not computed
+    int32_t propagate_one(const uint8_t* input, int output) const;
+};
+
+// Features (HalfKA) : every piece, kings included, on its square, for each bucket of king squares.
+// Each perspective sees the board from its own side, black's board being flipped vertically, and a king
+// on files e-h mirrors the board horizontally so the king always sits on files a-d. The bucket layout
+// only covers those 32 squares and comes with the network : fewer buckets, smaller feature transformer
+constexpr int FEATURES_PER_BUCKET = 2 * 6 * 64;  // own / their pieces x piece type x square
+constexpr int MAX_KING_BUCKETS    = 32;
+
+using KingBuckets = std::array<uint8_t, 32>;  // bucket of each king square, rank by rank, files a-d
+
+// default layout : a bucket per square on the back rank, pairs on the second, then wider areas
+constexpr int         DEFAULT_NUM_KING_BUCKETS = 8;
+constexpr KingBuckets DEFAULT_KING_BUCKETS     = {
+  0, 1, 2, 3,  //
+  4, 4, 5, 5,  //
+  6, 6, 6, 6,  //
+  6, 6, 6, 6,  //
+  7, 7, 7, 7,  //
+  7, 7, 7, 7,  //
+  7, 7, 7, 7,  //
+  7, 7, 7, 7,  //
+};
+
+// squares of 'perspective' are xor'ed with this, it depends on the side and on the file of its king
+inline int orientation(types::Color perspective, types::Square king_square) {
+    const int flip = perspective == types::Color::BLACK ? 56 : 0;
+    return flip ^ (((static_cast<int>(king_square) ^ flip) & 7) >= 4 ? 7 : 0);
+}
+
+// changes whenever the shape or the quantization of the network does, files made for another one are refused
+constexpr uint32_t architecture_hash() {
+    const uint32_t values[] = {FEATURES_PER_BUCKET, size, L2_SIZE, NUM_OUTPUTS, FT_SCALE, WEIGHT_SHIFT, OUTPUT_SCALE};
+    uint32_t       hash     = 2166136261u;
+
+    for (uint32_t value : values)
+        hash = (hash ^ value) * 16777619u;
+
+    return hash;
+}
+
+// Network file : this header, then for the feature transformer, the hidden and the output layer
+// their biases and their weights. Every section starts on a 64 byte boundary and holds the values in
+// the exact layout the kernels read, so a mapped file is used as it is
+struct alignas(64) NetFileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t arch_hash;
+    uint32_t num_features;
+    uint32_t ft_size;
+    uint32_t hidden_size;
+    uint32_t output_size;
+    int32_t  ft_scale;
+    int32_t  weight_shift;
+    int32_t  output_scale;
+    uint32_t num_king_buckets;
+    uint8_t  king_buckets[32];  // layout the feature transformer was trained with
+    uint64_t checksum;          // FNV-1a over the 64-bit words following the header
+};
+
+constexpr char     NET_FILE_MAGIC[8] = "SHZ-NET";
+constexpr uint32_t NET_FILE_VERSION  = 3;
 
 class NNue {
    public:
@@ -49,45 +197,92 @@ class NNue {
         int16_t accumulation[2][size];
 
         int16_t* operator[](types::Color color) {
-            assert(color == WHITE || color == BLACK);
-            return accumulation[color];
+            assert(color == types::Color::WHITE || color == types::Color::BLACK);
+            return accumulation[static_cast<int>(color)];
         }
 
-        const uint16_t* operator[](types::Color color) const {
-            assert(color == WHITE || color == BLACK);
-            return accumulation[color];
+        const int16_t* operator[](types::Color color) const {
+            assert(color == types::Color::WHITE || color == types::Color::BLACK);
+            return accumulation[static_cast<int>(color)];
         }
     };
 
-    LinearLayer l_0;
-    LinearLayer l_1;
-    LinearLayer l_2;
-
-    void                 refresh_accumulator(const LinearLayer& layer, const std::vector<uint32_t>& active_features,
-                                             types::Color perspective);
-    void                 update_accumulator(const LinearLayer& layer, const std::vector<uint32_t>& removed_features,
-                                            const std::vector<uint32_t>& added_features, types::Color perspective);
-    std::vector<int16_t> clipped_relu(std::vector<int16_t> output, const std::vector<int16_t> input) const;
-    std::vector<int16_t> linear(const LinearLayer& layer, std::vector<int16_t>& output,
-                                const std::vector<int16_t>& input) const;
-    float                nnue_eval(const position::Position& pos_1, NNue::Accumulator<size>& caches) const;
+    LinearLayer l_0;                           // feature transformer, int16
+    AffineLayer l_1{2 * size, L2_SIZE, true};  // both perspectives -> hidden, mostly zero inputs
+    AffineLayer l_2{L2_SIZE, NUM_OUTPUTS};     // hidden -> output, one output per bucket
+
+    // evaluation of 'pos' from its accumulator, which belongs to the searching thread (see AccumulatorStack)
+    int nnue_eval(const position::Position& pos, const NNue::Accumulator<size>& accumulator) const;
+
+    // evaluations of 'n' unrelated positions (offline rescoring) into 'out', each one from scratch. Large
+    // batches are split between 'threads' threads, by default as many as the machine has
+    void evaluate_batch(const position::Position* positions, int n, int* out, int threads = 0) const;
+
+    int num_features() const { return num_king_buckets * FEATURES_PER_BUCKET; }
+
+    // output bucket of a position, from its number of pieces : 2-4 pieces is the first one, 29-32 the last
+    static int output_bucket(const position::Position& pos);
+
+    // bucket of the king of 'perspective' on 'king_square'
+    int king_bucket(types::Color perspective, types::Square king_square) const {
+        const int sq = static_cast<int>(king_square) ^ orientation(perspective, king_square);
+        return king_buckets[(sq >> 3) * 4 + (sq & 7)];
+    }
+
+    // accumulators of 'perspective' are the same for every king square with the same slot : same bucket,
+    // same side of the board
+    int king_slot(types::Color perspective, types::Square king_square) const {
+        return king_bucket(perspective, king_square) * 2 + (orientation(perspective, king_square) & 1);
+    }
+
+    // index of a piece among the features of 'perspective'
+    int feature(types::Color     perspective,
+                types::Square    king_square,
+                types::PieceType piece_type,
+                types::Square    square,
+                types::Color     color) const {
+        const int kind = (color == perspective ? 0 : 6) + static_cast<int>(piece_type);
+        const int sq   = static_cast<int>(square) ^ orientation(perspective, king_square);
+
+        return (king_bucket(perspective, king_square) * 12 + kind) * 64 + sq;
+    }
+
+    NNue() = default;
+    ~NNue();
+
+    NNue(const NNue&)            = delete;
+    NNue& operator=(const NNue&) = delete;
+
+    // maps a network file and points the layers at it, nothing is parsed or copied
+    bool load(const std::string& path);
+    bool save(const std::string& path) const;
+
+    // uses the network embedded in the executable at build time, in place
+    bool load_embedded();
+
+    // tells loaded networks apart, every successful load gets a new one. 0 until a network is loaded
+    uint32_t id() const { return network_id; }
+
+   private:
+    bool use_network(const char* data, const std::size_t bytes);
+
+    memory::Allocation mapping;  // the loaded network file
+    uint32_t           network_id       = 0;
+    int                num_king_buckets = DEFAULT_NUM_KING_BUCKETS;
+    KingBuckets        king_buckets     = DEFAULT_KING_BUCKETS;
 };
 
-extern NNue                    nnue = NNue();
-extern NNue::Accumulator<size> caches;
+// the network, shared by every search thread : it is only written while loading, never during a search
+extern NNue nnue;
 
-// useful methods
-int feature_index(types::Square king_square, types::Square square, types::Color color, types::PieceType piece_type) {
-    int p_idx = static_cast<int>(piece_type) * 2 + static_cast<int>(color);
-    return (static_cast<int>(square) + (p_idx + static_cast<int>(king_square) * 10)) * 64;
-}
+// value of the EvalFile option that selects the embedded network
+constexpr char EMBEDDED_NET_NAME[] = "<embedded>";
+
+// loads the network named by the EvalFile option, the embedded one when it is empty or EMBEDDED_NET_NAME
+bool init_network(const std::string& eval_file);
 
-uint32_t feature_key(types::Square king_square, types::PieceType piece_type, types::Square square, types::Color color);
-std::vector<uint32_t> get_active_features(const position::Position& pos, types::Color color);
-std::vector<uint32_t> get_removed_features(const position::Position& cur_pos, const position::Position& prev_pos,
-                                           types::Color color);
-std::vector<uint32_t> get_added_features(const position::Position& cur_pos, const position::Position& prev_pos,
-                                         types::Color color);
+// useful methods
+FeatureList get_active_features(const NNue& network, const position::Position& pos, types::Color perspective);
 
 }  // namespace nnue
 }  // namespace Shahrazad
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include "position.h"
+#include "accumulator.h"
 #include "move.h"
 #include <cassert>
 #include <vector>
@@ -137,6 +138,12 @@ unsigned int Position::numberOf(types::PieceType piece, types::Color color) cons
 }
 
 void Position::make_null_move() {
+    // nothing moved, the accumulator of the next ply is a plain copy of this one
+    if (accumulators)
+    {
+        accumulators->push(nnue::DirtyPieces());
+    }
+
     switch_side();
     played_positions.push_back(position_key);
     ply_fromNull = 0;
@@ -145,12 +152,26 @@ void Position::make_null_move() {
 }
 
 void Position::take_null_move() {
+    nnue::AccumulatorStack* stack = accumulators;
+
     // I am not really sure wheather or not that is the right thing to do
     *this = *prev;
+
+    if (stack)
+    {
+        stack->pop();
+    }
 }
 
 void Position::undo_move() {
+    nnue::AccumulatorStack* stack = accumulators;
+
     *this = *prev;
+
+    if (stack)
+    {
+        stack->pop();
+    }
     // static position::Position previous = position::Position(played_positions[played_positions.size() - 1]);
     // this->prev = &previous;
 }
@@ -233,6 +254,45 @@ uint64_t genPositionKey(const Position& pos) {
     }
 }
 
+uint64_t key_scheme() {
+    // FNV-1a over every key in use
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    auto mix = [&h](uint64_t key) {
+        h ^= key;
+        h *= 0x100000001b3ULL;
+    };
+
+    for (const auto& keys : pieceKeys)
+    {
+        for (uint64_t key : keys)
+            mix(key);
+    }
+
+    for (uint64_t key : sideKey)
+        mix(key);
+
+    return h;
+}
+
+// key of the position after 'move' without making it, mirrors what do_move does to the board
+uint64_t Position::key_after(const types::Move& move) const {
+    const int              from     = move.getFrom();
+    const int              to       = move.getTo();
+    const types::PieceType piece    = pieceOn(from);
+    const types::PieceType captured = pieceOn(to);
+    uint64_t               key      = position_key;
+
+    key ^= pieceKeys[static_cast<int>(piece)][from] ^ pieceKeys[static_cast<int>(piece)][to];
+
+    if (captured != types::PieceType::NOPE)
+    {
+        key ^= pieceKeys[static_cast<int>(captured)][to];
+    }
+
+    return key ^ sideKey[0] ^ sideKey[1];
+}
+
 void Position::reset() {
     white_pawns   = board::Bitboard();
     white_king    = board::Bitboard();
@@ -7,11 +7,18 @@
 
 
 namespace Shahrazad {
+namespace nnue {
+class AccumulatorStack;
+}
+
 namespace position {
 
 inline uint64_t pieceKeys[12][64];
 inline uint64_t sideKey[2];
 
+// fingerprint of the zobrist keys, keys only mean something across runs if it matches
+uint64_t key_scheme();
+
 
 class Position {
    public:
@@ -40,12 +47,14 @@ class Position {
     bool      attacked_black[64];
     bool      castle_perm[2];
     bool      inCheck;
-    bool      needs_refresh[2];
 
     uint64_t              position_key;
     std::vector<uint64_t> played_positions;
     Position*             prev;
 
+    // NNUE accumulators of the thread searching this position, moves record their changes in it
+    nnue::AccumulatorStack* accumulators = nullptr;
+
 
     Position() :
         current_side(types::Color::WHITE),
@@ -80,6 +89,7 @@ class Position {
     unsigned int numberOf(types::PieceType piece, types::Color color) const;
     types::Square king_square(types::Color color) const;
     types::Color getColor(types::Square sq) const;
+    uint64_t key_after(const types::Move& move) const;
 };
 
 
@@ -21,9 +21,21 @@ template<bool pvNode>
 int search::Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::SearchStack* ss);
 
 tt::TranspositionTable transposition_table;
-const int              ageMask = 0b11111000;
 
-uint8_t search::ttAge(uint8_t ageBoundPV) { return (ageBoundPV & ageMask) >> 3; }
+void new_game() {
+    transposition_table.clear();
+
+    // threads that never searched have nothing to clear yet
+    for (thread::ThreadData& t : thread::threads_data)
+    {
+        if (!t.allocated())
+            continue;
+
+        t.eval_cache->clear();
+        t.local_tt->clear();
+        t.accumulators->clear_refresh_cache();
+    }
+}
 
 // just another hashing function
 uint64_t hash(const uint64_t key) {
@@ -140,10 +152,6 @@ bool search::isDraw(const position::Position& pos) {
     return isRepetition(pos) || isFiftyMovesDraw(pos) || isMaterialDraw(pos);
 }
 
-uint8_t search::pack(uint8_t bound, bool wasPv, uint8_t age) {
-    return static_cast<uint8_t>(bound + (wasPv << 2) + (age << 3));
-}
-
 int search::get_history_score(const position::Position& pos, SearchData* search_data, const types::Move& move,
                               SearchStack* ss) {
     int score = 0;
@@ -312,6 +320,63 @@ bool search::SEE(const position::Position pos, types::Move& move, int thresh_hol
 
 types::Move get_best_move(const PvTable* pvTable) { return pvTable->pvArray[0][0]; }
 
+// TT lookup for a node searched to 'depth'. Only shallow nodes look in the thread's local cache, and a
+// local hit shallower than the node still asks the shared table so it can't hide a deeper entry there
+static bool tt_probe(thread::ThreadData* thread_data, const uint64_t key, const int depth, tt::TT_data& data) {
+    tt::TT_data local;
+    const bool  local_hit = depth < tt::local_tt_depth && thread_data->local_tt->probe(key, local);
+
+    if (local_hit && local.depth >= depth)
+    {
+        data = local;
+        return true;
+    }
+
+    if (transposition_table.probe(key, data) && (!local_hit || data.depth >= local.depth))
+    {
+        return true;
+    }
+
+    if (local_hit)
+    {
+        data = local;
+    }
+
+    return local_hit;
+}
+
+// shallow results stay in the thread's local cache, deeper ones are written through to the shared table
+static void tt_store(thread::ThreadData* thread_data, const uint64_t key, const tt::TT_data& data) {
+    if (data.depth < tt::local_tt_depth)
+    {
+        tt::TT_data local = data;
+        local.age         = transposition_table.generation();
+        thread_data->local_tt->store(key, local);
+        return;
+    }
+
+    if (tt::local_tt_depth)
+    {
+        thread_data->local_tt->invalidate(key);
+    }
+
+    transposition_table.save_entry(key, data);
+}
+
+// raw static evaluation of the thread's position, looked up in its eval cache first
+static int static_eval(thread::ThreadData* thread_data) {
+    const position::Position& pos = thread_data->pos;
+    int                       eval;
+
+    if (!thread_data->eval_cache->probe(pos.position_key, nnue::nnue.id(), eval))
+    {
+        eval = eval::network_eval(pos, nnue::nnue, *thread_data->accumulators);
+        thread_data->eval_cache->store(pos.position_key, nnue::nnue.id(), eval);
+    }
+
+    return eval;
+}
+
 template<bool pvNode>
 int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode, thread::ThreadData* thread_data,
                               search::SearchStack* ss) {
@@ -325,9 +390,15 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
     constexpr int LMR_SCORE_BONUS_THRESHOLD    = 53;
     constexpr int MAX_DOUBLE_EXTENSIONS        = 11;
 
+    // the thread's own tables, allocated by this thread on its first search
+    if (ss->ply == 0)
+    {
+        thread_data->allocate();
+    }
+
     // Thread data and search stack
     position::Position* pos              = &thread_data->pos;
-    search::SearchData* search_data      = &thread_data->search_data;
+    search::SearchData* search_data      = thread_data->search_data.get();
     search::SearchInfo* info             = &thread_data->info;
     search::PvTable*    pv_table         = &thread_data->pvTable;
     const bool          inCheck          = pos->inCheck;
@@ -340,6 +411,15 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
     bool                improve;
     movegen::MoveList   list;
 
+    // Point the TT counters at this thread's own copy, and the moves at its accumulators
+    if (isRootNode)
+    {
+        tt::stats = &thread_data->tt_stats;
+
+        pos->accumulators = thread_data->accumulators.get();
+        pos->accumulators->reset();
+    }
+
     // Initialize PV length for this ply if not in singular extension search
     if (!excludedMove_val)
     {
@@ -377,7 +457,7 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
         // Maximum depth check
         if (ss->ply >= search::MAX_DEPTH - 1)
         {
-            return inCheck ? 0 : eval::network_eval(*pos, nnue::nnue, nnue::caches);
+            return inCheck ? 0 : static_eval(thread_data);
         }
 
         // Mate distance pruning
@@ -393,9 +473,11 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
     }
 
     // Transposition table lookup
-    tt::TT_Entry*     tt_entry = search::transposition_table.probe(pos->position_key);
-    tt::TT_data       tt_data  = tt_entry ? tt_entry->read() : tt::TT_data();
-    const bool        tt_exist = !excludedMove_val && tt_entry;
+    tt::TT_data       tt_data(search::SCORE_NONE, static_cast<int16_t>(types::Bound::NO_BOUND), 0, search::SCORE_NONE,
+                              pos->position_key, 0);
+    const bool        tt_hit   = tt_probe(thread_data, pos->position_key, depth, tt_data);
+    const bool        tt_exist = !excludedMove_val && tt_hit;
+    const bool        ttPv     = pvNode || (tt_hit && tt_data.was_pv);
     const uint16_t    move_val = tt_exist ? tt_data.move : static_cast<int>(types::MoveType::NOMOVE);
     const types::Move tt_move  = tt_exist ? types::Move(move_val) : types::Move();
 
@@ -405,6 +487,7 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
             || (tt_data.bound == static_cast<int16_t>(types::Bound::LOWER) && tt_data.value >= beta)
             || tt_data.bound == static_cast<int16_t>(types::Bound::EXACT)))
     {
+        TT_STAT(cutoffs[tt_data.bound]++);
         return tt_data.eval;
     }
 
@@ -432,8 +515,7 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
     else if (tt_exist)
     {
         // Use or compute eval from transposition table
-        rawEval =
-          (tt_data.value != search::SCORE_NONE) ? tt_data.eval : eval::network_eval(*pos, nnue::nnue, nnue::caches);
+        rawEval = (tt_data.value != search::SCORE_NONE) ? tt_data.eval : static_eval(thread_data);
 
         eval = ss->staticEval = rawEval;
 
@@ -448,15 +530,9 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
     }
     else
     {
-        // Compute fresh evaluation
-        rawEval = eval::network_eval(*pos, nnue::nnue, nnue::caches);
+        // Compute fresh evaluation (the eval cache remembers it, the TT only holds search results)
+        rawEval = static_eval(thread_data);
         eval    = rawEval;
-
-        // Store basic evaluation in TT
-        tt::TT_data new_data(rawEval, types::Bound::NO_BOUND, types::MoveType::NOMOVE, search::SCORE_NONE,
-                             pos->position_key, 0);
-        tt_entry->save(new_data);
-        transposition_table.save_entry(tt_entry);
     }
 
     // Determine if position is improving
@@ -657,8 +733,11 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
         // Adjust depth based on extensions
         int new_depth = depth - 1 + extension;
 
-        // Make the move
-        movegen::do_move(std::ref<position::Position>(*pos), move);
+        // Make the move, the child's TT cluster and eval cache slot are fetched while do_move updates the board
+        const uint64_t child_key = pos->key_after(move);
+        transposition_table.prefetch(child_key);
+        thread_data->eval_cache->prefetch(child_key);
+        movegen::do_move(*pos, move, child_key);
         ss->contHistEntry = &search_data->contHist[static_cast<int>(pos->pieceOn(move.getFrom()))];
         list.append(move);
         info->nodes++;
@@ -827,9 +906,8 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
         }
 
         // Save position to transposition table
-        tt::TT_data new_data(rawEval, bound, best_move.data(), bestScore, pos->position_key, depth);
-        tt_entry->save(new_data);
-        transposition_table.save_entry(tt_entry);
+        tt::TT_data new_data(rawEval, bound, best_move.data(), bestScore, pos->position_key, depth, ttPv);
+        tt_store(thread_data, pos->position_key, new_data);
     }
 
     return bestScore;
@@ -839,7 +917,7 @@ int Shahrazad::search::search(int alpha, int beta, int depth, const bool cutNode
 template<bool pvNode>
 int Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::SearchStack* ss) {
     position::Position* pos         = &thread_data->pos;
-    search::SearchData* search_data = &thread_data->search_data;
+    search::SearchData* search_data = thread_data->search_data.get();
     search::SearchInfo* info        = &thread_data->info;
     const bool          inCheck     = pos->inCheck;
     int                 best_score;
@@ -858,22 +936,23 @@ int Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::Sea
 
     if (ss->ply >= search::MAX_DEPTH - 1)
     {
-        return inCheck ? 0 : eval::network_eval(*pos, nnue::nnue, nnue::caches);
+        return inCheck ? 0 : static_eval(thread_data);
     }
 
-    tt::TT_Entry* tt_entry = transposition_table.probe(pos->position_key);
-    const bool    tt_hit   = tt_entry ? true : false;
-    tt::TT_data   tt_data  = tt_entry->read();
+    tt::TT_data tt_data(search::SCORE_NONE, static_cast<int16_t>(types::Bound::NO_BOUND), 0, search::SCORE_NONE,
+                        pos->position_key, 0);
+    const bool  tt_hit = tt_probe(thread_data, pos->position_key, 0, tt_data);
 
     if (!pvNode && tt_data.value != search::SCORE_NONE
         && ((tt_data.bound == static_cast<int16_t>(types::Bound::UPPER) && tt_data.value <= alpha)
             || (tt_data.bound == static_cast<int16_t>(types::Bound::LOWER) && tt_data.value >= beta)
             || tt_data.bound == static_cast<int16_t>(types::Bound::EXACT)))
     {
+        TT_STAT(cutoffs[tt_data.bound]++);
         return tt_data.value;
     }
 
-    const bool ttPv = pvNode || (tt_hit && formerPv(tt_data.bound));
+    const bool ttPv = pvNode || (tt_hit && tt_data.was_pv);
 
     if (inCheck)
     {
@@ -882,7 +961,7 @@ int Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::Sea
     }
     else if (tt_hit)
     {
-        rawEval        = tt_data.eval != SCORE_NONE ? tt_data.eval : eval::network_eval(*pos, nnue, caches);
+        rawEval        = tt_data.eval != SCORE_NONE ? tt_data.eval : static_eval(thread_data);
         ss->staticEval = best_score = adjustEvalWithCorrHist(pos, search_data, rawEval);
 
         if (tt_data.value != search::SCORE_NONE
@@ -895,13 +974,8 @@ int Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::Sea
     }
     else
     {
-        rawEval    = eval::network_eval(*pos, nnue, pos.accumulator);
+        rawEval    = static_eval(thread_data);
         best_score = ss->staticEval = adjustEvalWithCorrHist(pos, search_data, rawEval);
-
-        tt::TT_data new_data(rawEval, static_cast<int16_t>(types::Bound::NO_BOUND), types::MoveType::NOMOVE,
-                             search::SCORE_NONE, pos->position_key, 0);
-        tt_entry->save(new_data);
-        transposition_table.save_entry(tt_entry);
     }
 
     if (best_score >= beta)
@@ -947,8 +1021,11 @@ int Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::Sea
             }
         }
 
-        ss->move = move;
-        movegen::do_move(*pos, move);
+        ss->move                 = move;
+        const uint64_t child_key = pos->key_after(move);
+        transposition_table.prefetch(child_key);
+        thread_data->eval_cache->prefetch(child_key);
+        movegen::do_move(*pos, move, child_key);
 
         info->nodes++;
         const int score = -search::Quiescence<pvNode>(-beta, -alpha, thread_data, ss + 1);
@@ -984,9 +1061,8 @@ int Quiescence(int alpha, int beta, thread::ThreadData* thread_data, search::Sea
 
         int bound = best_score >= beta ? static_cast<int>(types::Bound::LOWER) : static_cast<int>(types::Bound::UPPER);
 
-        tt::TT_data new_data(rawEval, bound, best_move.data(), best_score, pos->position_key, 0);
-        tt_entry->save(new_data);
-        transposition_table.save_entry(tt_entry);
+        tt::TT_data new_data(rawEval, bound, best_move.data(), best_score, pos->position_key, 0, ttPv);
+        tt_store(thread_data, pos->position_key, new_data);
 
         return best_score;
     }
@@ -78,5 +78,9 @@ enum class state : int {
     SEARCH_STATE
 };
 
+// a new game (or anything else that clears the transposition table) : the table and every thread's
+// own caches start empty, none of them may keep results the table no longer has
+void new_game();
+
 }  // namespace search
 }  // namespace Shahrazad
\ No newline at end of file
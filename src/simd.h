@@ -2,211 +2,684 @@
 
 #include "nnue.h"
 
+#include <algorithm>
 #include <cstdint>
-#include <arm_neon.h>
+#include <cstring>
 
+#if defined(__AVX2__)
+    #include <immintrin.h>
+#endif
+
+// Every kernels_*.cpp includes this header with different compiler flags, each of them gets its own
+// namespace so the differently compiled copies of these functions never get merged by the linker
+#if !defined(SIMD_ARCH)
+    #if defined(__AVX512F__) && defined(__AVX512BW__)
+        #define SIMD_ARCH avx512
+    #elif defined(__AVX2__)
+        #define SIMD_ARCH avx2
+    #else
+        #define SIMD_ARCH generic
+    #endif
+#endif
 
-#if defined(__aarch64__) || defined(__ARM_NEON)
 
 namespace Shahrazad {
 namespace nnue {
 namespace simd {
+inline namespace SIMD_ARCH {
 
 using InputType  = std::int32_t;
 using OutputType = std::uint8_t;
 
-// Define the width of a SIMD register (128 bits) in terms of bytes (16 bytes = 128 bits)
-constexpr uint8_t register_width = 16;
-
-// Approximates the natural logarithm of the input 'x' using a polynomial expansion.
-float log_approx(float x) {
-    // Coefficients for the polynomial approximation of ln(x)
-    const float ln_coeffs[] = {0.2402265069591007f, 0.2851821182387283f, 0.4000097213251230f,
-                               0.6666671873348118f};
-    // Calculate (x - 1), which is used for the approximation
-    float x1 = x - 1.0f;
-    // Square of (x - 1)
-    float x2 = x1 * x1;
-    // Polynomial approximation: ln(x) ≈ c0 + c1 * (x - 1) + c2 * (x - 1)^2 + c3 * (x - 1)^3
-    float result = ln_coeffs[0] + ln_coeffs[1] * x1 + ln_coeffs[2] * x2 + ln_coeffs[3] * x2 * x1;
-    // Return the approximated logarithm value
-    return result;
-}
-
-// Computes the base-2 logarithm of 'input' scaled by 'scale'.
-// Uses the log_approx function for natural logarithm approximation and converts it to log2.
-float log2_weight_scale(int32_t input, float scale) {
-    // Convert input integer to float
-    float input_float = (float) input;
-    // Scale the input value by the provided scale factor
-    float scaled_input = input_float * scale;
-    // Approximate the natural logarithm of the scaled input
-    float ln_scaled_input = log_approx(scaled_input);
-    // Convert natural logarithm to base-2 logarithm using the constant ln(2) ≈ 1.4427
-    float log2_scaled_input = ln_scaled_input * 1.4426950408889634f;
-    // Return the base-2 logarithm of the scaled input
-    return log2_scaled_input;
-}
-
-// Horizontally adds the sum of four 64-bit integers (sum0, sum1, sum2, sum3) and adds the bias.
-// This function is likely using NEON intrinsics to vectorize the addition.
-int64x2_t _128_haddx2(int64_t sum0, int64_t sum1, int64_t sum2, int64_t sum3, int64x2_t bias) {
-    // Add sum0 and sum1 to get the first intermediate sum
-    int64_t sum0123 = vadd_s64(sum0, sum1);
-    // Add sum2 and sum3 to get the second intermediate sum
-    int64_t sum2345 = vadd_s64(sum2, sum3);
-    // Add both intermediate sums together to combine all four values
-    int64x2_t sum = vadd_s64(sum0123, sum2345);
-    // Add the bias to the final sum and return the result
-    return vadd_s64(sum, bias);
-}
-
-std::vector<int16_t>
-linear(const LinearLayer& layer, std::vector<int16_t>& output, const std::vector<int8_t>& input) {
-    // Ensure that the number of inputs and outputs are divisible by register width and 4, respectively
-    assert(layer.get_num_inputs() % register_width == 0);
-    assert(layer.get_num_outputs() % 4 == 0);
-
-    const int num_input_subsets  = layer.get_num_inputs() / register_width;
-    const int num_output_subsets = layer.get_num_outputs() / 4;
-
-    // Loop through each output subset (processing 4 outputs at a time)
-    for (int i = 0; i < num_output_subsets; ++i)
-    {
-        const int offset = i * 4 * layer.get_num_inputs();
-
-        // Initialize 16-bit accumulators for summing input-weight products (for 4 output neurons)
-        int16x8_t sum0 = vdupq_n_s16(0);
-        int16x8_t sum1 = vdupq_n_s16(0);
-        int16x8_t sum2 = vdupq_n_s16(0);
-        int16x8_t sum3 = vdupq_n_s16(0);
-
-        // Loop through each input subset (processing register_width elements at a time)
-        for (int j = 0; j < num_input_subsets; ++j)
-        {
-            // Load input data into a 128-bit vector register
-            int8x16_t in = vld1q_s8(reinterpret_cast<const int8_t*>(input.data() + j * register_width));
-            // Load weights for the current input subset
-            const int16_t* weight_ptr = layer.getWeights(offset + j * register_width);
-            // Multiply-accumulate input data with weights for each output neuron
-            sum0 =
-              vmlal_s8(sum0, vget_low_s8(in), vld1q_s8(reinterpret_cast<const int8_t*>(weight_ptr)));
-            sum1 = vmlal_s8(sum1, vget_low_s8(in),
-                            vld1q_s8(reinterpret_cast<const int8_t*>(weight_ptr + register_width)));
-            sum2 =
-              vmlal_s8(sum2, vget_low_s8(in),
-                       vld1_s8(reinterpret_cast<const int8_t*>(weight_ptr + 2 * register_width)));
-            sum3 =
-              vmlal_s8(sum3, vget_low_s8(in),
-                       vld1_s8(reinterpret_cast<const int8_t*>(weight_ptr + 3 * register_width)));
-        }
-
-        // Load the bias for the current 4 output neurons
-        int32x4_t bias = vld1q_s32(reinterpret_cast<const int32_t*>(&layer.getBias()[i * 4]));
-
-        // Add the accumulated values for all output neurons and apply bias
-        int32x4_t outval0 = vaddq_s32(vpaddlq_s16(sum0), bias);
-        int32x4_t outval1 = vaddq_s32(vpaddlq_s16(sum1), bias);
-        int32x4_t outval2 = vaddq_s32(vpaddlq_s16(sum2), bias);
-        int32x4_t outval3 = vaddq_s32(vpaddlq_s16(sum3), bias);
-
-        // Store the output values into the output vector
-        vst1q_s32(reinterpret_cast<int32_t*>(&output[i * 4]), outval0);
-        vst1q_s32(reinterpret_cast<int32_t*>(&output[i * 4 + 1]), outval1);
-        vst1q_s32(reinterpret_cast<int32_t*>(&output[i * 4 + 2]), outval2);
-        vst1q_s32(reinterpret_cast<int32_t*>(&output[i * 4 + 3]), outval3);
-    }
-
-    return output;
-}
-
-// Optimized version of clipped ReLU using ARM NEON SIMD instructions for Apple M1 (ARM64)
-std::vector<int16_t> clipped_relu(std::vector<int16_t> output, const std::vector<int16_t>& input) {
-    int16x8_t zero = vdupq_n_s16(0);  // Vector of zeros
-    int16x8_t one  = vdupq_n_s16(1);  // Vector of ones
-
-    // Process 8 elements at a time using SIMD instructions
-    for (std::size_t i = 0; i < size; i += 8)
-    {
-        int16x8_t input_vec = vld1q_s16(&input[i]);  // Load 8 values from input
-        int16x8_t clipped =
-          vmaxq_s16(zero, vminq_s16(input_vec, one));  // Apply min(1, max(0, input))
-        vst1q_s16(&output[i], clipped);                // Store the result
+#if !defined(__AVX2__)
+
+// Plain loops for the machines without AVX2, the compiler vectorizes them as far as the target allows
+
+// Clipped ReLU of the accumulator into the uint8 input of the first hidden layer
+inline void clipped_relu_u8(const int16_t* input, uint8_t* output, int count) {
+    for (int i = 0; i < count; i++)
+        output[i] = std::min(std::max(input[i], int16_t(0)), int16_t(ACTIVATION_MAX));
+}
+
+// Rebuild one perspective of the accumulator from the biases and every active feature
+inline void refresh_accumulator(const LinearLayer&       layer,
+                                NNue::Accumulator<size>& new_acc,
+                                const FeatureList&       active_features,
+                                types::Color             perspective) {
+    const int16_t* biases = layer.getBias();
+    int16_t*       acc    = new_acc[perspective];
+
+    for (std::size_t i = 0; i < size; i++)
+        acc[i] = biases[i];
+
+    for (uint32_t a : active_features)
+    {
+        const int16_t* weights = layer.getWeights(a);
+
+        for (std::size_t i = 0; i < size; i++)
+            acc[i] += weights[i];
+    }
+}
+
+// Incrementally update one perspective : previous values, minus removed features, plus added ones
+inline void update_accumulator(const LinearLayer&             layer,
+                               NNue::Accumulator<size>&       new_acc,
+                               const NNue::Accumulator<size>& prev_acc,
+                               const FeatureList&             removed_features,
+                               const FeatureList&             added_features,
+                               types::Color                   perspective) {
+    int16_t*       acc  = new_acc[perspective];
+    const int16_t* prev = prev_acc[perspective];
+
+    for (std::size_t i = 0; i < size; i++)
+        acc[i] = prev[i];
+
+    for (uint32_t r : removed_features)
+    {
+        const int16_t* weights = layer.getWeights(r);
+
+        for (std::size_t i = 0; i < size; i++)
+            acc[i] -= weights[i];
+    }
+
+    for (uint32_t a : added_features)
+    {
+        const int16_t* weights = layer.getWeights(a);
+
+        for (std::size_t i = 0; i < size; i++)
+            acc[i] += weights[i];
+    }
+}
+
+// Both perspectives of a move that removed 'removed' and added 'added' features for each of them. The
+// counts are template arguments so the loops over the rows are unrolled, every value of the previous
+// accumulator is read once and every value of the new one written once
+template<int removed, int added>
+inline void update_both(const LinearLayer&             layer,
+                        NNue::Accumulator<size>&       new_acc,
+                        const NNue::Accumulator<size>& prev_acc,
+                        const FeatureList*             removed_features,
+                        const FeatureList*             added_features) {
+    for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+    {
+        const int      p    = static_cast<int>(perspective);
+        int16_t*       acc  = new_acc[perspective];
+        const int16_t* prev = prev_acc[perspective];
+        const int16_t* sub[removed];
+        const int16_t* add[added];
+
+        for (int r = 0; r < removed; r++)
+            sub[r] = layer.getWeights(removed_features[p].values[r]);
+        for (int a = 0; a < added; a++)
+            add[a] = layer.getWeights(added_features[p].values[a]);
+
+        for (std::size_t i = 0; i < size; i++)
+        {
+            int16_t value = prev[i];
+
+            for (int r = 0; r < removed; r++)
+                value -= sub[r][i];
+            for (int a = 0; a < added; a++)
+                value += add[a][i];
+
+            acc[i] = value;
+        }
+    }
+}
+
+// u8 x i8 -> i32 dot products for the hidden layers, 'num_inputs' weights per output
+inline void affine_u8i8(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                        int num_inputs, int num_outputs) {
+    for (int j = 0; j < num_outputs; j++)
+    {
+        const int8_t* row = weights + j * num_inputs;
+        int32_t       sum = biases[j];
+
+        for (int i = 0; i < num_inputs; i++)
+            sum += input[i] * row[i];
+
+        output[j] = sum;
+    }
+}
+
+// Same sums as affine_u8i8 for inputs that are mostly zero, with the weights in 4-input blocks : for
+// every group of 4 inputs, their 4 weights of each output one after the other. Groups of 4 zero inputs
+// are skipped, for the others the whole block is read as one stream
+inline void affine_sparse_u8i8(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                               int num_inputs, int num_outputs) {
+    for (int j = 0; j < num_outputs; j++)
+        output[j] = biases[j];
+
+    for (int c = 0; c < num_inputs / 4; c++)
+    {
+        const uint8_t* in = input + c * 4;
+
+        if (!(in[0] | in[1] | in[2] | in[3]))
+            continue;
+
+        const int8_t* block = weights + c * num_outputs * 4;
+
+        for (int j = 0; j < num_outputs; j++)
+            output[j] += in[0] * block[j * 4] + in[1] * block[j * 4 + 1] + in[2] * block[j * 4 + 2]
+                       + in[3] * block[j * 4 + 3];
+    }
+}
+
+#endif  // End of portable SIMD code
+
+#if defined(__AVX2__)
+
+// Number of 16-bit elements per AVX2 register (__m256i)
+constexpr int avx2_lanes = 16;
+
+// Accumulator registers kept live at once, 16 of the 16 ymm registers would leave nothing for the weights
+constexpr int avx2_tile = 8;
+
+// Clipped ReLU of the accumulator into the uint8 input of the first hidden layer. packus saturates the
+// negative values to 0, only the upper bound has to be applied before packing 32 values per register
+inline void clipped_relu_u8(const int16_t* input, uint8_t* output, int count) {
+    assert(count % (2 * avx2_lanes) == 0);
+
+    const __m256i max = _mm256_set1_epi16(ACTIVATION_MAX);
+
+    for (int i = 0; i < count; i += 2 * avx2_lanes)
+    {
+        const __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+        const __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i + avx2_lanes));
+
+        // packus works inside each 128-bit lane, the permute puts the four 64-bit quarters back in order
+        const __m256i packed = _mm256_packus_epi16(_mm256_min_epi16(lo, max), _mm256_min_epi16(hi, max));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), _mm256_permute4x64_epi64(packed, 0xd8));
+    }
+}
+
+// Positions of the set bits of every byte, turns a movemask into a list of indices
+struct NonZeroTable {
+    alignas(16) uint16_t offsets[256][8];
+
+    constexpr NonZeroTable() :
+        offsets() {
+        for (int mask = 0; mask < 256; mask++)
+        {
+            int count = 0;
+
+            for (int bit = 0; bit < 8; bit++)
+                if (mask & (1 << bit))
+                    offsets[mask][count++] = bit;
+        }
+    }
+};
+
+inline constexpr NonZeroTable non_zero_table{};
+
+// most inputs the sparse hidden layer takes
+constexpr int MAX_SPARSE_INPUTS = 2 * size;
+
+// Indices of the groups of 4 inputs that aren't all zero, 8 groups per compare. 'indices' needs room
+// for 8 more entries than there are groups, every step stores 8 of them whatever its count
+inline int find_non_zero(const uint8_t* input, int num_groups, uint16_t* indices) {
+    assert(num_groups % 8 == 0);
+
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m128i eight = _mm_set1_epi16(8);
+    __m128i       base  = _mm_setzero_si128();
+    int           count = 0;
+
+    for (int i = 0; i < num_groups; i += 8)
+    {
+        const __m256i groups = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i * 4));
+        const int     mask   = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(groups, zero))) & 0xff;
+
+        const __m128i offsets = _mm_load_si128(reinterpret_cast<const __m128i*>(non_zero_table.offsets[mask]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(indices + count), _mm_add_epi16(base, offsets));
+
+        count += __builtin_popcount(mask);
+        base = _mm_add_epi16(base, eight);
+    }
+
+    return count;
+}
+
+// horizontal sum of the eight 32-bit lanes
+inline int32_t reduce_add_epi32(__m256i sum) {
+    __m128i lanes = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    lanes         = _mm_add_epi32(lanes, _mm_shuffle_epi32(lanes, 0x4e));
+    lanes         = _mm_add_epi32(lanes, _mm_shuffle_epi32(lanes, 0xb1));
+    return _mm_cvtsi128_si32(lanes);
+}
+
+    #if defined(__AVX512F__) && defined(__AVX512BW__)
+
+// Number of 16-bit elements per AVX-512 register (__m512i)
+constexpr int avx512_lanes = 32;
+
+// 8 of the 32 zmm registers hold accumulators, 256 values per pass over the feature rows
+constexpr int avx512_tile = 8;
+
+// Rebuild one perspective of the accumulator from the biases and every active feature
+inline void refresh_accumulator(const LinearLayer&       layer,
+                                NNue::Accumulator<size>& new_acc,
+                                const FeatureList&       active_features,
+                                types::Color             perspective) {
+    static_assert(size % (avx512_lanes * avx512_tile) == 0, "Size must be divisible by the tile width");
+
+    const int16_t* biases = layer.getBias();
+
+    for (int tile = 0; tile < static_cast<int>(size); tile += avx512_lanes * avx512_tile)
+    {
+        __m512i regs[avx512_tile];
+
+        for (int k = 0; k < avx512_tile; k++)
+            regs[k] = _mm512_load_si512(&biases[tile + k * avx512_lanes]);
+
+        for (uint32_t a : active_features)
+        {
+            const int16_t* weights = layer.getWeights(a) + tile;
+
+            for (int k = 0; k < avx512_tile; k++)
+                regs[k] = _mm512_add_epi16(regs[k], _mm512_load_si512(weights + k * avx512_lanes));
+        }
+
+        for (int k = 0; k < avx512_tile; k++)
+            _mm512_store_si512(&new_acc[perspective][tile + k * avx512_lanes], regs[k]);
+    }
+}
+
+// Incrementally update one perspective : previous values, minus removed features, plus added ones
+inline void update_accumulator(const LinearLayer&             layer,
+                               NNue::Accumulator<size>&       new_acc,
+                               const NNue::Accumulator<size>& prev_acc,
+                               const FeatureList&             removed_features,
+                               const FeatureList&             added_features,
+                               types::Color                   perspective) {
+    static_assert(size % (avx512_lanes * avx512_tile) == 0, "Size must be divisible by the tile width");
+
+    for (int tile = 0; tile < static_cast<int>(size); tile += avx512_lanes * avx512_tile)
+    {
+        __m512i regs[avx512_tile];
+
+        for (int k = 0; k < avx512_tile; k++)
+            regs[k] = _mm512_load_si512(&prev_acc[perspective][tile + k * avx512_lanes]);
+
+        for (uint32_t r : removed_features)
+        {
+            const int16_t* weights = layer.getWeights(r) + tile;
+
+            for (int k = 0; k < avx512_tile; k++)
+                regs[k] = _mm512_sub_epi16(regs[k], _mm512_load_si512(weights + k * avx512_lanes));
+        }
+
+        for (uint32_t a : added_features)
+        {
+            const int16_t* weights = layer.getWeights(a) + tile;
+
+            for (int k = 0; k < avx512_tile; k++)
+                regs[k] = _mm512_add_epi16(regs[k], _mm512_load_si512(weights + k * avx512_lanes));
+        }
+
+        for (int k = 0; k < avx512_tile; k++)
+            _mm512_store_si512(&new_acc[perspective][tile + k * avx512_lanes], regs[k]);
     }
+}
+
+// Both perspectives of a move that removed 'removed' and added 'added' features for each of them, see
+// the portable version. A tile of each perspective stays in registers while all its rows are applied
+template<int removed, int added>
+inline void update_both(const LinearLayer&             layer,
+                        NNue::Accumulator<size>&       new_acc,
+                        const NNue::Accumulator<size>& prev_acc,
+                        const FeatureList*             removed_features,
+                        const FeatureList*             added_features) {
+    const int16_t* sub[2][removed];
+    const int16_t* add[2][added];
+
+    for (int p = 0; p < 2; p++)
+    {
+        for (int r = 0; r < removed; r++)
+            sub[p][r] = layer.getWeights(removed_features[p].values[r]);
+        for (int a = 0; a < added; a++)
+            add[p][a] = layer.getWeights(added_features[p].values[a]);
+    }
+
+    for (int tile = 0; tile < static_cast<int>(size); tile += avx512_lanes * avx512_tile)
+    {
+        for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+        {
+            const int p = static_cast<int>(perspective);
+            __m512i   regs[avx512_tile];
+
+            for (int k = 0; k < avx512_tile; k++)
+                regs[k] = _mm512_load_si512(&prev_acc[perspective][tile + k * avx512_lanes]);
 
-    return output;
-}
-
-void refresh_accumulator(const LinearLayer&       layer,
-                         NNue::Accumulator<size>& new_acc,
-                         const std::vector<int>&  active_features,
-                         int                      side) {
-    constexpr int register_width = 8;  // Number of 16-bit elements per NEON register (int16x8_t)
-    static_assert(size % register_width == 0, "Size must be divisible by the register width");
-    constexpr int subSets_number = size / register_width;  // Number of subsets
-    int16x8_t     regs[subSets_number];                    // SIMD registers
+            for (int r = 0; r < removed; r++)
+                for (int k = 0; k < avx512_tile; k++)
+                    regs[k] = _mm512_sub_epi16(regs[k], _mm512_load_si512(sub[p][r] + tile + k * avx512_lanes));
 
-    // Load biases into SIMD registers
-    const std::vector<int16_t>& biases = layer.getBias();
-    for (int i = 0; i < subSets_number; ++i)
-        regs[i] = vld1q_s16(&biases[i * register_width]);  // Load biases for this subset
+            for (int a = 0; a < added; a++)
+                for (int k = 0; k < avx512_tile; k++)
+                    regs[k] = _mm512_add_epi16(regs[k], _mm512_load_si512(add[p][a] + tile + k * avx512_lanes));
 
-    // Add contributions from active features
-    for (int a : active_features)
+            for (int k = 0; k < avx512_tile; k++)
+                _mm512_store_si512(&new_acc[perspective][tile + k * avx512_lanes], regs[k]);
+        }
+    }
+}
+
+// u8 x i8 -> i32 dot products for the hidden layers, 64 inputs per step.
+// With VNNI a single vpdpbusd does the multiply, the pairwise add and the accumulation,
+// without it maddubs/madd do the same in two steps like the AVX2 version.
+// Four outputs are computed together so every input load is reused four times
+inline void affine_u8i8(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                        int num_inputs, int num_outputs) {
+    assert(num_inputs % 64 == 0);
+    assert(num_outputs % 4 == 0);
+
+        #if !defined(__AVX512VNNI__)
+    const __m512i ones = _mm512_set1_epi16(1);
+        #endif
+
+    auto dot = [&](__m512i sum, __m512i in, __m512i w) {
+        #if defined(__AVX512VNNI__)
+        return _mm512_dpbusd_epi32(sum, in, w);
+        #else
+        return _mm512_add_epi32(sum, _mm512_madd_epi16(_mm512_maddubs_epi16(in, w), ones));
+        #endif
+    };
+
+    for (int j = 0; j < num_outputs; j += 4)
     {
-        const int16_t* weights =
-          layer.getWeights(a);  // Cache pointer to the weights of the feature
-        for (int i = 0; i < subSets_number; ++i)
+        __m512i sum0 = _mm512_setzero_si512();
+        __m512i sum1 = _mm512_setzero_si512();
+        __m512i sum2 = _mm512_setzero_si512();
+        __m512i sum3 = _mm512_setzero_si512();
+
+        const int8_t* row = weights + j * num_inputs;
+
+        for (int i = 0; i < num_inputs; i += 64)
         {
-            // Load the weights for the current feature and accumulate them
-            int16x8_t weight_vec = vld1q_s16(&weights[i * register_width]);
-            regs[i]              = vaddq_s16(regs[i], weight_vec);  // SIMD addition
+            const __m512i in = _mm512_loadu_si512(input + i);
+            sum0             = dot(sum0, in, _mm512_loadu_si512(row + i));
+            sum1             = dot(sum1, in, _mm512_loadu_si512(row + num_inputs + i));
+            sum2             = dot(sum2, in, _mm512_loadu_si512(row + 2 * num_inputs + i));
+            sum3             = dot(sum3, in, _mm512_loadu_si512(row + 3 * num_inputs + i));
         }
+
+        // the two halves of each register added, then the AVX2 horizontal sum. The zero masking extracts
+        // are the plain extract without the undefined pass-through gcc 12 warns about (cast included)
+        auto reduce = [](__m512i sum) {
+            return reduce_add_epi32(_mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xf, sum, 0),
+                                                     _mm512_maskz_extracti64x4_epi64(0xf, sum, 1)));
+        };
+
+        output[j]     = biases[j] + reduce(sum0);
+        output[j + 1] = biases[j + 1] + reduce(sum1);
+        output[j + 2] = biases[j + 2] + reduce(sum2);
+        output[j + 3] = biases[j + 3] + reduce(sum3);
     }
+}
+
+// Sparse version of affine_u8i8 (see the portable one for the weight layout) : each non zero group of
+// 4 inputs is broadcast and multiplied with its block, 16 outputs per register
+inline void affine_sparse_u8i8(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                               int num_inputs, int num_outputs) {
+    constexpr int max_regs = 4;
+    const int     regs     = num_outputs / 16;
+    assert(num_outputs % 16 == 0 && regs <= max_regs);
+    assert(num_inputs <= MAX_SPARSE_INPUTS);
+
+        #if !defined(__AVX512VNNI__)
+    const __m512i ones = _mm512_set1_epi16(1);
+        #endif
+
+    uint16_t  groups[MAX_SPARSE_INPUTS / 4 + 8];
+    const int count = find_non_zero(input, num_inputs / 4, groups);
+
+    __m512i sums[max_regs];
+
+    for (int k = 0; k < regs; k++)
+        sums[k] = _mm512_loadu_si512(biases + k * 16);
+
+    for (int i = 0; i < count; i++)
+    {
+        int32_t packed;
+        std::memcpy(&packed, input + groups[i] * 4, 4);
+
+        const __m512i in    = _mm512_set1_epi32(packed);
+        const int8_t* block = weights + groups[i] * num_outputs * 4;
+
+        for (int k = 0; k < regs; k++)
+        {
+            const __m512i w = _mm512_loadu_si512(block + k * 64);
+        #if defined(__AVX512VNNI__)
+            sums[k] = _mm512_dpbusd_epi32(sums[k], in, w);
+        #else
+            sums[k] = _mm512_add_epi32(sums[k], _mm512_madd_epi16(_mm512_maddubs_epi16(in, w), ones));
+        #endif
+        }
+    }
+
+    for (int k = 0; k < regs; k++)
+        _mm512_storeu_si512(output + k * 16, sums[k]);
+}
+
+    #else
+
+// Rebuild one perspective of the accumulator from the biases and every active feature
+inline void refresh_accumulator(const LinearLayer&       layer,
+                                NNue::Accumulator<size>& new_acc,
+                                const FeatureList&       active_features,
+                                types::Color             perspective) {
+    static_assert(size % (avx2_lanes * avx2_tile) == 0, "Size must be divisible by the tile width");
+
+    const int16_t* biases = layer.getBias();
+
+    for (int tile = 0; tile < static_cast<int>(size); tile += avx2_lanes * avx2_tile)
+    {
+        __m256i regs[avx2_tile];
+
+        for (int k = 0; k < avx2_tile; k++)
+            regs[k] = _mm256_load_si256(reinterpret_cast<const __m256i*>(&biases[tile + k * avx2_lanes]));
+
+        for (uint32_t a : active_features)
+        {
+            const int16_t* weights = layer.getWeights(a) + tile;
+
+            for (int k = 0; k < avx2_tile; k++)
+                regs[k] = _mm256_add_epi16(
+                  regs[k], _mm256_load_si256(reinterpret_cast<const __m256i*>(weights + k * avx2_lanes)));
+        }
+
+        for (int k = 0; k < avx2_tile; k++)
+            _mm256_store_si256(reinterpret_cast<__m256i*>(&new_acc[perspective][tile + k * avx2_lanes]), regs[k]);
+    }
+}
+
+// Incrementally update one perspective : previous values, minus removed features, plus added ones
+inline void update_accumulator(const LinearLayer&             layer,
+                               NNue::Accumulator<size>&       new_acc,
+                               const NNue::Accumulator<size>& prev_acc,
+                               const FeatureList&             removed_features,
+                               const FeatureList&             added_features,
+                               types::Color                   perspective) {
+    static_assert(size % (avx2_lanes * avx2_tile) == 0, "Size must be divisible by the tile width");
+
+    for (int tile = 0; tile < static_cast<int>(size); tile += avx2_lanes * avx2_tile)
+    {
+        __m256i regs[avx2_tile];
 
-    // Store the results back into the accumulator
-    for (int i = 0; i < subSets_number; ++i)
-        vst1q_s16(&new_acc[side][i * register_width], regs[i]);  // Store the results back
+        for (int k = 0; k < avx2_tile; k++)
+            regs[k] =
+              _mm256_load_si256(reinterpret_cast<const __m256i*>(&prev_acc[perspective][tile + k * avx2_lanes]));
+
+        for (uint32_t r : removed_features)
+        {
+            const int16_t* weights = layer.getWeights(r) + tile;
+
+            for (int k = 0; k < avx2_tile; k++)
+                regs[k] = _mm256_sub_epi16(
+                  regs[k], _mm256_load_si256(reinterpret_cast<const __m256i*>(weights + k * avx2_lanes)));
+        }
+
+        for (uint32_t a : added_features)
+        {
+            const int16_t* weights = layer.getWeights(a) + tile;
+
+            for (int k = 0; k < avx2_tile; k++)
+                regs[k] = _mm256_add_epi16(
+                  regs[k], _mm256_load_si256(reinterpret_cast<const __m256i*>(weights + k * avx2_lanes)));
+        }
+
+        for (int k = 0; k < avx2_tile; k++)
+            _mm256_store_si256(reinterpret_cast<__m256i*>(&new_acc[perspective][tile + k * avx2_lanes]), regs[k]);
+    }
 }
 
-// Optimized update of accumulator using SIMD instructions for Apple M1
-void update_accumulator(const LinearLayer&             layer,
+// Both perspectives of a move that removed 'removed' and added 'added' features for each of them, see
+// the portable version. A tile of each perspective stays in registers while all its rows are applied
+template<int removed, int added>
+inline void update_both(const LinearLayer&             layer,
                         NNue::Accumulator<size>&       new_acc,
                         const NNue::Accumulator<size>& prev_acc,
-                        const std::vector<int>&        removed_features,
-                        const std::vector<int>&        added_features,
-                        int                            side) {
+                        const FeatureList*             removed_features,
+                        const FeatureList*             added_features) {
+    const int16_t* sub[2][removed];
+    const int16_t* add[2][added];
+
+    for (int p = 0; p < 2; p++)
+    {
+        for (int r = 0; r < removed; r++)
+            sub[p][r] = layer.getWeights(removed_features[p].values[r]);
+        for (int a = 0; a < added; a++)
+            add[p][a] = layer.getWeights(added_features[p].values[a]);
+    }
 
-    static_assert(size % register_width == 0, "Size must be divisible by register width");
-    constexpr int subSets_number = size / register_width;
-    int16x4_t     regs[subSets_number];  // SIMD registers
+    for (int tile = 0; tile < static_cast<int>(size); tile += avx2_lanes * avx2_tile)
+    {
+        for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+        {
+            const int p = static_cast<int>(perspective);
+            __m256i   regs[avx2_tile];
+
+            for (int k = 0; k < avx2_tile; k++)
+                regs[k] =
+                  _mm256_load_si256(reinterpret_cast<const __m256i*>(&prev_acc[perspective][tile + k * avx2_lanes]));
+
+            for (int r = 0; r < removed; r++)
+                for (int k = 0; k < avx2_tile; k++)
+                    regs[k] = _mm256_sub_epi16(
+                      regs[k], _mm256_load_si256(reinterpret_cast<const __m256i*>(sub[p][r] + tile + k * avx2_lanes)));
 
-    // Load previous accumulator into SIMD registers
-    for (int i = 0; i < subSets_number; i++)
-        regs[i] = vld1_s64(&prev_acc[side][i * register_width]);
+            for (int a = 0; a < added; a++)
+                for (int k = 0; k < avx2_tile; k++)
+                    regs[k] = _mm256_add_epi16(
+                      regs[k], _mm256_load_si256(reinterpret_cast<const __m256i*>(add[p][a] + tile + k * avx2_lanes)));
 
-    // Subtract weights for removed features
-    for (int r : removed_features)
+            for (int k = 0; k < avx2_tile; k++)
+                _mm256_store_si256(reinterpret_cast<__m256i*>(&new_acc[perspective][tile + k * avx2_lanes]), regs[k]);
+        }
+    }
+}
+
+// Dot products of unsigned 8-bit activations with signed 8-bit weights for the hidden layers :
+// maddubs multiplies adjacent u8/i8 pairs into i16 sums, madd against ones widens those to i32.
+// 'weights' holds 'num_inputs' weights per output, output after output
+inline void affine_u8i8(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                        int num_inputs, int num_outputs) {
+    assert(num_inputs % 32 == 0);
+
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    for (int j = 0; j < num_outputs; j++)
     {
-        for (int j = 0; j < subSets_number; j++)
-            regs[j] = vsubq_s16(regs[j], vld1_s64(&layer.getWeights(r)[j * register_width]));
+        __m256i       sum = _mm256_setzero_si256();
+        const int8_t* row = weights + j * num_inputs;
+
+        for (int i = 0; i < num_inputs; i += 32)
+        {
+            const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input + i));
+            const __m256i w  = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+            sum              = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(in, w), ones));
+        }
+
+        output[j] = biases[j] + reduce_add_epi32(sum);
     }
+}
+
+// Sparse version of affine_u8i8 (see the portable one for the weight layout) : each non zero group of
+// 4 inputs is broadcast and multiplied with its block, 8 outputs per register
+inline void affine_sparse_u8i8(const uint8_t* input, const int8_t* weights, const int32_t* biases, int32_t* output,
+                               int num_inputs, int num_outputs) {
+    constexpr int max_regs = 8;
+    const int     regs     = num_outputs / 8;
+    assert(num_outputs % 8 == 0 && regs <= max_regs);
+    assert(num_inputs <= MAX_SPARSE_INPUTS);
+
+    const __m256i ones = _mm256_set1_epi16(1);
+
+    uint16_t  groups[MAX_SPARSE_INPUTS / 4 + 8];
+    const int count = find_non_zero(input, num_inputs / 4, groups);
+
+    __m256i sums[max_regs];
+
+    for (int k = 0; k < regs; k++)
+        sums[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(biases + k * 8));
 
-    // Add weights for new added features
-    for (int a : added_features)
+    for (int i = 0; i < count; i++)
     {
-        for (int j = 0; j < subSets_number; j++)
-            regs[j] = vaddq_s16(regs[j], vld1_s64(&(layer.getWeights(a)[j * register_width])));
+        int32_t packed;
+        std::memcpy(&packed, input + groups[i] * 4, 4);
+
+        const __m256i in    = _mm256_set1_epi32(packed);
+        const int8_t* block = weights + groups[i] * num_outputs * 4;
+
+        for (int k = 0; k < regs; k++)
+        {
+            const __m256i w = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + k * 32));
+            sums[k]         = _mm256_add_epi32(sums[k], _mm256_madd_epi16(_mm256_maddubs_epi16(in, w), ones));
+        }
     }
 
-    // Store the updated results back into the accumulator
-    for (int i = 0; i < subSets_number; i++)
-        vst1q_s64(&new_acc[side][i * register_width], regs[i]);
+    for (int k = 0; k < regs; k++)
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + k * 8), sums[k]);
 }
 
-#endif // End of SIMD code for Apple M1 (ARM64)
+    #endif  // End of AVX-512 / AVX2 accumulator kernels
+
+#endif  // End of SIMD code for AVX2 (x86-64)
+
+// Updates both perspectives from the previous accumulator. The usual moves have a kernel of their own :
+// a quiet move (1 removed, 1 added feature), a capture (2 removed, 1 added) and castling (2 removed,
+// 2 added), anything else is done one perspective after the other
+inline void update_accumulators(const LinearLayer&             layer,
+                                NNue::Accumulator<size>&       new_acc,
+                                const NNue::Accumulator<size>& prev_acc,
+                                const FeatureList*             removed_features,
+                                const FeatureList*             added_features) {
+    const int removed = removed_features[0].size();
+    const int added   = added_features[0].size();
 
+    if (removed_features[1].size() == removed && added_features[1].size() == added)
+    {
+        if (removed == 1 && added == 1)
+        {
+            return update_both<1, 1>(layer, new_acc, prev_acc, removed_features, added_features);
+        }
+        if (removed == 2 && added == 1)
+        {
+            return update_both<2, 1>(layer, new_acc, prev_acc, removed_features, added_features);
+        }
+        if (removed == 2 && added == 2)
+        {
+            return update_both<2, 2>(layer, new_acc, prev_acc, removed_features, added_features);
+        }
+    }
+
+    for (auto perspective : {types::Color::WHITE, types::Color::BLACK})
+        update_accumulator(layer, new_acc, prev_acc, removed_features[static_cast<int>(perspective)],
+                           added_features[static_cast<int>(perspective)], perspective);
+}
+
+}  // namespace SIMD_ARCH
 }  // namespace simd
 }  // namespace nnue
 }  // namespace Shahrazad
-
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <thread>
+#include "accumulator.h"
+#include "evalcache.h"
+#include "memory.h"
 #include "search.h"
+#include "ttable.h"
 
 
 namespace Shahrazad {
@@ -21,8 +25,32 @@ struct ThreadData {
     uint8_t            id = 0;
     uint8_t            rootDepth;
     uint8_t            nmpPlies;
-    search::SearchData search_data;
     search::SearchInfo info;
+    tt::TT_Stats       tt_stats;
+
+    // The large per thread tables, each in its own (huge page backed when possible) block : history
+    // tables, eval cache, local TT and NNUE accumulators (one per ply). All of them are allocated by the
+    // search thread itself the first time it searches (see allocate()), so their pages are first touched,
+    // and placed, on the NUMA node that thread runs on. Empty until then
+    memory::LargePtr<search::SearchData>     search_data;
+    memory::LargePtr<eval::EvalCache>        eval_cache;
+    memory::LargePtr<tt::LocalTT>            local_tt;
+    memory::LargePtr<nnue::AccumulatorStack> accumulators;
+
+    // called by the search thread at every root, only the first call allocates
+    void allocate() {
+        if (search_data.get())
+        {
+            return;
+        }
+
+        search_data  = memory::make_large<search::SearchData>();
+        eval_cache   = memory::make_large<eval::EvalCache>();
+        local_tt     = memory::make_large<tt::LocalTT>();
+        accumulators = memory::make_large<nnue::AccumulatorStack>();
+    }
+
+    bool allocated() const { return search_data.get(); }
 };
 
 // done with this node
@@ -49,6 +77,33 @@ inline uint64_t get_nodes() {
     return nodes;
 }
 
+// TT counters summed over all threads
+inline tt::TT_Stats get_tt_stats() {
+    tt::TT_Stats totals;
+    for (auto& t : threads_data)
+    {
+        totals += t.tt_stats;
+    }
+
+    return totals;
+}
+
+// eval cache hits per thousand probes over all threads
+inline uint64_t eval_cache_hitrate() {
+    uint64_t hits   = 0ULL;
+    uint64_t probes = 0ULL;
+    for (auto& t : threads_data)
+    {
+        if (t.allocated())
+        {
+            hits += t.eval_cache->hits;
+            probes += t.eval_cache->probes;
+        }
+    }
+
+    return probes ? hits * 1000 / probes : 0;
+}
+
 // stop the thread for whatever reason
 void thread_interrupt() {
     for (auto& t : threads_data)
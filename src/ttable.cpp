@@ -1,47 +1,524 @@
 #include "ttable.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 
 namespace Shahrazad {
 namespace tt {
 
-// hashing func for indexing
-uint64_t hash(const int16_t pos_key) {
-    uint64_t h   = 5381;
-    uint64_t key = static_cast<uint64_t>(pos_key);
-    h            = ((h << 5) + h) + key;
-    return h;
+// pack the entry data into a single 64 bit word
+uint64_t TT_Entry::encode(const TT_data& d) {
+    return static_cast<uint64_t>(d.move) | static_cast<uint64_t>(static_cast<uint16_t>(d.eval)) << 16
+         | static_cast<uint64_t>(static_cast<uint16_t>(d.value)) << 32 | static_cast<uint64_t>(d.depth) << 48
+         | static_cast<uint64_t>(pack(static_cast<uint8_t>(d.bound), d.was_pv, d.age)) << 56;
+}
+
+// unpack a data word written by encode()
+TT_data TT_Entry::decode(const uint64_t key, const uint64_t word) {
+    const uint8_t ageBoundPV = static_cast<uint8_t>(word >> 56);
+
+    TT_data d(static_cast<int16_t>(word >> 16), ttBound(ageBoundPV), static_cast<uint16_t>(word),
+              static_cast<int16_t>(word >> 32), key, static_cast<uint8_t>(word >> 48), ttPv(ageBoundPV));
+    d.age = ttAge(ageBoundPV);
+    return d;
 }
 
-// get data from entry
-inline TT_data TT_Entry::read() const {
-    return TT_data(data.eval, data.bound, data.move, data.value, data.pos_key, data.depth);
+bool TT_Entry::matches(const uint64_t key) const {
+    const uint64_t word = data.load(std::memory_order_relaxed);
+    return (key_xor.load(std::memory_order_relaxed) ^ word) == key;
 }
 
-// save data in entry
-inline void TT_Entry::save(TT_data& d) { data = TT_data(d); }
+bool TT_Entry::is_empty() const {
+    return data.load(std::memory_order_relaxed) == 0 && key_xor.load(std::memory_order_relaxed) == 0;
+}
+
+// get data from entry, the caller has to check matches() first
+TT_data TT_Entry::read(const uint64_t key) const { return decode(key, data.load(std::memory_order_relaxed)); }
+
+// save data in entry, the two stores may interleave with another thread's stores
+// which is fine since the xor check rejects the mixed result
+void TT_Entry::save(const TT_data& d) {
+    const uint64_t word = encode(d);
+    data.store(word, std::memory_order_relaxed);
+    key_xor.store(d.pos_key ^ word, std::memory_order_relaxed);
+}
+
+// map the full key onto [0, capacity) without a division
+std::size_t TranspositionTable::index(const uint64_t key) const {
+    __extension__ using uint128 = unsigned __int128;
+    return static_cast<std::size_t>((static_cast<uint128>(key) * capacity) >> 64);
+}
+
+void TranspositionTable::allocate(const std::size_t buckets) {
+    memory::large_free(allocation);
+    table    = nullptr;
+    shared   = nullptr;
+    capacity = table_size = 0;
+
+    allocation = memory::large_alloc(buckets * sizeof(TT_Bucket));
+    capacity   = buckets;
+    table_size = buckets * sizeof(TT_Bucket);
+    table      = static_cast<TT_Bucket*>(allocation.ptr);
+
+    for (std::size_t i = 0; i < capacity; i++)
+    {
+        new (&table[i]) TT_Bucket();
+    }
+
+    generations = 0;
+}
+
+void TranspositionTable::resize(const std::size_t mb) { allocate((mb * 1024 * 1024) / sizeof(TT_Bucket)); }
+
+void TranspositionTable::clear() {
+    for (std::size_t i = 0; i < capacity; i++)
+    {
+        for (TT_Entry& entry : table[i].entries)
+        {
+            entry.data.store(0, std::memory_order_relaxed);
+            entry.key_xor.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    generations = 0;
+}
 
 // get entry from table (as in looking around)
-TT_Entry* TranspositionTable::probe(const uint64_t key) const {
-    int        _hash   = hash(static_cast<int16_t>(key));
-    int        index   = _hash % capacity;
-    TT_Bucket* cluster = &table[index];
+bool TranspositionTable::probe(const uint64_t key, TT_data& data) const {
+    if (!capacity)
+    {
+        return false;
+    }
+
+    const TT_Bucket* cluster  = &table[index(key)];
+    bool             occupied = false;
+
+    TT_STAT(probes++);
 
     for (int i = 0; i < BUCKET_SIZE; i++)
     {
-        if (cluster->entries[i].data.pos_key == key)
-            return &cluster->entries[i];
+        // load the data word once so the check and the decoded data agree
+        const uint64_t word = cluster->entries[i].data.load(std::memory_order_relaxed);
+
+        if ((cluster->entries[i].key_xor.load(std::memory_order_relaxed) ^ word) == key && word)
+        {
+            data = TT_Entry::decode(key, word);
+            TT_STAT(hits++);
+            return true;
+        }
+
+        occupied |= word != 0;
+    }
+
+    if (occupied)
+    {
+        TT_STAT(mismatches++);
+    }
+
+    return false;
+}
+
+void TranspositionTable::save_entry(const uint64_t key, const TT_data& data) {
+    if (!capacity)
+    {
+        return;
+    }
+
+    const uint8_t current = generation();
+    TT_Bucket*    cluster = &table[index(key)];
+    TT_Entry*     replace = nullptr;
+    TT_Entry*     fallback = nullptr;
+    int           worst    = 0;
+    int           worst_pv = 0;
+    Replace       reason   = Replace::SHALLOWER;
+
+    // reuse the slot of the same position, otherwise an empty one, otherwise the one that is
+    // worth the least : shallow and written many searches ago. PV entries of the current
+    // search are only replaced if nothing else is left in the cluster
+    for (int i = 0; i < BUCKET_SIZE; i++)
+    {
+        TT_Entry* entry = &cluster->entries[i];
+
+        if (entry->matches(key) || entry->is_empty())
+        {
+            replace = entry;
+            reason  = entry->is_empty() ? Replace::EMPTY : Replace::SAME_KEY;
+            break;
+        }
+
+        const TT_data old   = entry->read(key);
+        const uint8_t age   = (MAX_AGE + current - old.age) & AGE_MASK;
+        const int     worth = old.depth - AGE_WEIGHT * age;
+
+        if (old.was_pv && age == 0)
+        {
+            if (!fallback || worth < worst_pv)
+            {
+                fallback = entry;
+                worst_pv = worth;
+            }
+
+            continue;
+        }
+
+        if (!replace || worth < worst)
+        {
+            replace = entry;
+            worst   = worth;
+            reason  = age ? Replace::STALE : Replace::SHALLOWER;
+        }
+    }
+
+    TT_STAT(replacements[static_cast<int>(replace ? reason : Replace::SHALLOWER)]++);
+
+    TT_data d = data;
+    d.pos_key = key;
+    d.age     = current;
+    (replace ? replace : fallback)->save(d);
+}
+
+void TranspositionTable::new_search() {
+    if (shared)
+    {
+        // the first process to start a search since this one's last search bumps it, the others adopt it
+        uint8_t       seen = generations;
+        const uint8_t next = (generations + 1) & AGE_MASK;
+
+        generations = shared->generation.compare_exchange_strong(seen, next, std::memory_order_relaxed)
+                      ? next
+                      : seen & AGE_MASK;
+        return;
+    }
+
+    generations = (generations + 1) & AGE_MASK;
+}
+
+uint8_t TranspositionTable::relative_age(const uint8_t age) const { return (MAX_AGE + generation() - age) & AGE_MASK; }
+
+int TranspositionTable::hashfull() const {
+    const std::size_t samples = std::min(capacity, HASHFULL_SAMPLE);
+    const uint8_t     current = generation();
+    int               count   = 0;
+
+    if (!samples)
+    {
+        return 0;
+    }
+
+    for (std::size_t i = 0; i < samples; i++)
+    {
+        for (const TT_Entry& entry : table[i].entries)
+        {
+            if (!entry.is_empty() && TT_Entry::decode(0, entry.data.load(std::memory_order_relaxed)).age == current)
+            {
+                count++;
+            }
+        }
+    }
+
+    return static_cast<int>(count * 1000 / (samples * BUCKET_SIZE));
+}
+
+bool LocalTT::probe(const uint64_t key, TT_data& data) const {
+    const Entry& entry = entries[key & (LOCAL_TT_SIZE - 1)];
+
+    if (entry.key != key || !entry.data)
+    {
+        return false;
+    }
+
+    data = TT_Entry::decode(key, entry.data);
+    return true;
+}
+
+void LocalTT::store(const uint64_t key, const TT_data& data) {
+    entries[key & (LOCAL_TT_SIZE - 1)] = {key, TT_Entry::encode(data)};
+}
+
+// drop a shallow result once a deeper one for the same key went to the shared table
+void LocalTT::invalidate(const uint64_t key) {
+    Entry& entry = entries[key & (LOCAL_TT_SIZE - 1)];
+
+    if (entry.key == key)
+    {
+        entry = Entry();
+    }
+}
+
+void LocalTT::clear() {
+    for (Entry& entry : entries)
+        entry = Entry();
+}
+
+TT_Stats& TT_Stats::operator+=(const TT_Stats& other) {
+    probes += other.probes;
+    hits += other.hits;
+    mismatches += other.mismatches;
+
+    for (int i = 0; i < 4; i++)
+    {
+        replacements[i] += other.replacements[i];
+        cutoffs[i] += other.cutoffs[i];
+    }
+
+    return *this;
+}
+
+void TranspositionTable::occupancy(uint64_t (&by_depth)[64], uint64_t (&by_age)[MAX_AGE]) const {
+    std::fill(std::begin(by_depth), std::end(by_depth), 0);
+    std::fill(std::begin(by_age), std::end(by_age), 0);
+
+    for (std::size_t i = 0; i < capacity; i++)
+    {
+        for (const TT_Entry& entry : table[i].entries)
+        {
+            if (entry.is_empty())
+            {
+                continue;
+            }
+
+            const TT_data d = TT_Entry::decode(0, entry.data.load(std::memory_order_relaxed));
+            by_depth[std::min<int>(d.depth, 63)]++;
+            by_age[relative_age(d.age)]++;
+        }
+    }
+}
+
+void TranspositionTable::print_stats(std::ostream& os, const TT_Stats& totals) const {
+    static const char* replace_names[] = {"empty", "same key", "stale", "shallower"};
+    static const char* bound_names[]   = {"none", "upper", "lower", "exact"};
+
+    uint64_t by_depth[64];
+    uint64_t by_age[MAX_AGE];
+    occupancy(by_depth, by_age);
+
+#ifndef TT_STATS
+    os << "tt stats : counters not compiled in (build with TT_STATS=1)\n";
+#endif
+
+    os << "tt probes " << totals.probes << " hits " << totals.hits << " mismatches " << totals.mismatches << '\n';
+
+    for (int i = 0; i < 4; i++)
+        os << "tt replaced (" << replace_names[i] << ") " << totals.replacements[i] << '\n';
+
+    for (int i = 0; i < 4; i++)
+        os << "tt cutoffs (" << bound_names[i] << ") " << totals.cutoffs[i] << '\n';
+
+    os << "tt hashfull " << hashfull() << " generation " << static_cast<int>(generation()) << '\n';
+
+    for (int d = 0; d < 64; d++)
+    {
+        if (by_depth[d])
+            os << "tt depth " << d << (d == 63 ? "+ " : " ") << by_depth[d] << '\n';
     }
 
-    return nullptr;
+    for (int a = 0; a < MAX_AGE; a++)
+    {
+        if (by_age[a])
+            os << "tt age -" << a << ' ' << by_age[a] << '\n';
+    }
 }
 
-void TranspositionTable::save_entry(const TT_Entry* entry) {
-    int        _hash   = hash(static_cast<int16_t>(entry->read().pos_key));
-    TT_Bucket* cluster = &table[_hash % capacity];
-    // We have to do some checking for the entry age to decide the replacement
-    if (cluster)
-        cluster->entries[0] = *entry;
+bool TranspositionTable::save(const std::string& path) const {
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+
+    if (!file)
+    {
+        return false;
+    }
+
+    TT_FileHeader header = {};
+    std::memcpy(header.magic, TT_FILE_MAGIC, sizeof(header.magic));
+    header.version      = TT_FILE_VERSION;
+    header.bucket_bytes = sizeof(TT_Bucket);
+    header.key_scheme   = position::key_scheme();
+    header.capacity     = capacity;
+    header.generations  = generation();
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(table), table_size);
+
+    return static_cast<bool>(file);
 }
 
+bool TranspositionTable::load(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(TT_FileHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    // a private writable mapping : the buckets are used where they are, a page is only copied once
+    // the search writes to it, so the table never exists twice in memory
+    const std::size_t file_size = st.st_size;
+    void*             mapped    = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+
+    // reject files from another engine version, another entry layout or other zobrist keys,
+    // their entries would never verify against our keys or would decode to garbage.
+    // the capacity is checked by dividing the payload so a corrupt header can't overflow the product
+    const TT_FileHeader* header  = static_cast<const TT_FileHeader*>(mapped);
+    const std::size_t    payload = file_size - sizeof(TT_FileHeader);
+    const bool           valid   = std::memcmp(header->magic, TT_FILE_MAGIC, sizeof(header->magic)) == 0
+                          && header->version == TT_FILE_VERSION && header->bucket_bytes == sizeof(TT_Bucket)
+                          && header->key_scheme == position::key_scheme() && payload % sizeof(TT_Bucket) == 0
+                          && header->capacity == payload / sizeof(TT_Bucket) && header->capacity > 0;
+
+    if (!valid)
+    {
+        munmap(mapped, file_size);
+        return false;
+    }
+
+    memory::large_free(allocation);
+    allocation.ptr  = mapped;
+    allocation.size = file_size;
+    allocation.mode = memory::AllocMode::MAPPED;
+
+    shared      = nullptr;
+    table       = const_cast<TT_Bucket*>(reinterpret_cast<const TT_Bucket*>(header + 1));
+    capacity    = header->capacity;
+    table_size  = capacity * sizeof(TT_Bucket);
+    generations = header->generations & AGE_MASK;
+    return true;
+}
+
+bool TranspositionTable::attach_shared(const std::string& name, const std::size_t mb) {
+    const std::size_t buckets = (mb * 1024 * 1024) / sizeof(TT_Bucket);
+    bool              creator = true;
+    int               fd      = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+
+    if (fd < 0)
+    {
+        if (errno != EEXIST)
+        {
+            return false;
+        }
+
+        creator = false;
+        fd      = shm_open(name.c_str(), O_RDWR, 0600);
+
+        if (fd < 0)
+        {
+            return false;
+        }
+    }
+
+    // a table without a single bucket would turn every probe and store into a no-op for all processes
+    if (creator && (!buckets || ftruncate(fd, sizeof(TT_SharedHeader) + buckets * sizeof(TT_Bucket)) != 0))
+    {
+        close(fd);
+        shm_unlink(name.c_str());
+        return false;
+    }
+
+    // the creator may not have sized the object yet
+    struct stat st;
+
+    for (int tries = 0;; tries++)
+    {
+        if (fstat(fd, &st) != 0 || tries == 1000)
+        {
+            close(fd);
+            return false;
+        }
+
+        if (static_cast<std::size_t>(st.st_size) >= sizeof(TT_SharedHeader))
+            break;
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    const std::size_t size   = st.st_size;
+    void*             mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+
+    TT_SharedHeader* header = static_cast<TT_SharedHeader*>(mapped);
+
+    if (creator)
+    {
+        // ftruncate zero filled the buckets, which is exactly an empty table
+        std::memcpy(header->magic, TT_SHARED_MAGIC, sizeof(header->magic));
+        header->version      = TT_FILE_VERSION;
+        header->bucket_bytes = sizeof(TT_Bucket);
+        header->key_scheme   = position::key_scheme();
+        header->capacity     = buckets;
+        header->generation.store(0, std::memory_order_relaxed);
+        header->ready.store(1, std::memory_order_release);
+    }
+    else
+    {
+        for (int tries = 0; !header->ready.load(std::memory_order_acquire); tries++)
+        {
+            if (tries == 1000)
+            {
+                munmap(mapped, size);
+                return false;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+
+    const bool valid = std::memcmp(header->magic, TT_SHARED_MAGIC, sizeof(header->magic)) == 0
+                    && header->version == TT_FILE_VERSION && header->bucket_bytes == sizeof(TT_Bucket)
+                    && header->key_scheme == position::key_scheme()
+                    && (size - sizeof(TT_SharedHeader)) % sizeof(TT_Bucket) == 0
+                    && header->capacity == (size - sizeof(TT_SharedHeader)) / sizeof(TT_Bucket)
+                    && header->capacity > 0;
+
+    if (!valid)
+    {
+        munmap(mapped, size);
+        return false;
+    }
+
+    memory::large_free(allocation);
+    allocation.ptr  = mapped;
+    allocation.size = size;
+    allocation.mode = memory::AllocMode::MAPPED;
+
+    shared      = header;
+    table       = reinterpret_cast<TT_Bucket*>(header + 1);
+    capacity    = header->capacity;
+    table_size  = capacity * sizeof(TT_Bucket);
+    generations = header->generation.load(std::memory_order_relaxed) & AGE_MASK;
+
+    return true;
+}
+
+bool TranspositionTable::remove_shared(const std::string& name) { return shm_unlink(name.c_str()) == 0; }
+
 }  // namespace tt
-}  // namespace Shahrazad
\ No newline at end of file
+}  // namespace Shahrazad
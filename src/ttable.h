@@ -1,17 +1,38 @@
 #pragma once
 
+#include "memory.h"
 #include "search.h"
 #include "types.h"
 
+#include <atomic>
+#include <ostream>
+#include <string>
+
 
 namespace Shahrazad {
 namespace tt {
 
 // constants
-constexpr int         BUCKET_SIZE    = 3;
-constexpr std::size_t MAX_TABLE_SIZE = 4000;
-constexpr uint8_t     MAX_AGE        = 1 << 5;
-constexpr uint8_t     AGE_MASK       = MAX_AGE - 1;
+constexpr int         BUCKET_SIZE     = 3;
+constexpr std::size_t MAX_TABLE_SIZE  = 4000;
+constexpr uint8_t     MAX_AGE         = 1 << 5;
+constexpr uint8_t     AGE_MASK        = MAX_AGE - 1;
+constexpr int         AGE_WEIGHT      = 8;        // depth an entry is worth per search it has missed
+constexpr std::size_t HASHFULL_SAMPLE = 1000;     // clusters looked at for the hashfull estimate
+constexpr std::size_t LOCAL_TT_SIZE   = 1 << 14;  // entries of a thread's local cache, power of two
+
+// results searched shallower than this stay in the searching thread's LocalTT instead of the
+// shared table, 0 turns the local caches off
+inline int local_tt_depth = 0;
+
+// the age/bound/pv byte of an entry : bound in bits 0-1, pv flag in bit 2 and age in bits 3-7
+inline uint8_t pack(uint8_t bound, bool wasPv, uint8_t age) {
+    return static_cast<uint8_t>(bound + (wasPv << 2) + ((age & AGE_MASK) << 3));
+}
+
+inline uint8_t ttBound(uint8_t ageBoundPV) { return ageBoundPV & 0b11; }
+inline bool    ttPv(uint8_t ageBoundPV) { return ageBoundPV & 0b100; }
+inline uint8_t ttAge(uint8_t ageBoundPV) { return (ageBoundPV & 0b11111000) >> 3; }
 
 // structs
 struct TT_Entry;
@@ -24,61 +45,221 @@ struct TT_data {
     int16_t  eval;
     int16_t  bound;
     uint16_t move;
-    int8_t   value;
-    uint16_t pos_key;
+    int16_t  value;
+    uint64_t pos_key;
     uint8_t  depth;
+    bool     was_pv = false;
+    uint8_t  age    = 0;  // generation the entry was written in, set by the table
 
     TT_data() {};
 
-    TT_data(int16_t eval, int16_t bound, uint16_t move, int8_t value, uint16_t pos_key, uint8_t depth) {
+    TT_data(int16_t eval, int16_t bound, uint16_t move, int16_t value, uint64_t pos_key, uint8_t depth,
+            bool was_pv = false) {
         this->eval    = eval;
         this->bound   = bound;
         this->move    = move;
         this->value   = value;
         this->pos_key = pos_key;
         this->depth   = depth;
+        this->was_pv  = was_pv;
     }
 };
 
 // entry in the TT table
+// An entry is two 64 bit words written independently by any thread without a lock :
+//     data    = move | eval << 16 | value << 32 | depth << 48 | pack(bound, pv, age) << 56
+//     key_xor = pos_key ^ data
+// A reader only accepts the entry if key_xor ^ data gives back the probed key, so a
+// torn write (one word from one thread, the other word from another) is seen as a miss
 struct TT_Entry {
    protected:
-    TT_data data;
+    std::atomic<uint64_t> key_xor{0};
+    std::atomic<uint64_t> data{0};
 
    public:
     friend class TranspositionTable;
 
-    TT_data read() const;
+    static uint64_t encode(const TT_data& d);
+    static TT_data  decode(const uint64_t key, const uint64_t word);
+
+    // true if the entry currently holds data for 'key'
+    bool matches(const uint64_t key) const;
+    bool is_empty() const;
 
-    void save(TT_data& d);
+    TT_data read(const uint64_t key) const;
+
+    void save(const TT_data& d);
 };
 
 // bucket of entries can contain up to BUCKET_SIZE entries
-struct TT_Bucket {
+// a bucket is padded to a cache line so a probe never touches two lines
+// the age used for replacement decisions is kept per entry, in the data word
+struct alignas(64) TT_Bucket {
     TT_Entry entries[BUCKET_SIZE] = {};
-    uint16_t age;  // for replacement decision
 };
 
+static_assert(sizeof(TT_Bucket) == 64, "a TT bucket must fill exactly one cache line");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "TT entries rely on lock free 64 bit atomics");
+
+// Small direct mapped per thread cache in front of the shared table.
+// Qsearch and depth 1 nodes are probed and stored by every thread all the time, keeping them here
+// stops their cache lines from bouncing between cores. It uses the same data word as TT_Entry
+// but plain fields, since only its own thread ever touches it
+class LocalTT {
+   public:
+    bool probe(const uint64_t key, TT_data& data) const;
+    void store(const uint64_t key, const TT_data& data);
+    void invalidate(const uint64_t key);
+    void clear();
+
+   private:
+    struct Entry {
+        uint64_t key  = 0;
+        uint64_t data = 0;
+    };
+
+    Entry entries[LOCAL_TT_SIZE];
+};
+
+// why save_entry picked the slot it wrote to
+enum class Replace : int {
+    EMPTY,
+    SAME_KEY,
+    STALE,     // written during an older search
+    SHALLOWER  // written during this search, but with less depth
+};
+
+// Probe/store counters, only filled in when built with TT_STATS (make TT_STATS=1).
+// Every search thread owns one and points 'stats' at it, so counting never
+// bounces a shared cache line between cores
+struct TT_Stats {
+    uint64_t probes          = 0;
+    uint64_t hits            = 0;
+    uint64_t mismatches      = 0;   // misses in a cluster that held other keys
+    uint64_t replacements[4] = {};  // indexed by Replace
+    uint64_t cutoffs[4]      = {};  // indexed by types::Bound
+
+    TT_Stats& operator+=(const TT_Stats& other);
+};
+
+inline thread_local TT_Stats* stats = nullptr;
+
+#ifdef TT_STATS
+    #define TT_STAT(expr) \
+        do \
+        { \
+            if (tt::stats) \
+                tt::stats->expr; \
+        } while (0)
+#else
+    // still type checked so both builds stay in sync, but never executed
+    #define TT_STAT(expr) \
+        do \
+        { \
+            if (false) \
+                tt::stats->expr; \
+        } while (0)
+#endif
+
+// header written in front of the buckets by TranspositionTable::save
+// it is padded to a cache line so the buckets that follow it stay aligned when load maps the file
+struct alignas(64) TT_FileHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t bucket_bytes;
+    uint64_t key_scheme;
+    uint64_t capacity;
+    uint8_t  generations;
+};
+
+constexpr char     TT_FILE_MAGIC[8] = "SHZ-TT";
+constexpr uint32_t TT_FILE_VERSION  = 1;
+
+// header at the start of a shared memory table, the buckets follow it.
+// 'ready' is only set once the creating process has filled in the rest, and the
+// generation lives here so every attached process ages entries the same way
+struct alignas(64) TT_SharedHeader {
+    char                  magic[8];
+    uint32_t              version;
+    uint32_t              bucket_bytes;
+    uint64_t              key_scheme;
+    uint64_t              capacity;
+    std::atomic<uint32_t> ready;
+    std::atomic<uint8_t>  generation;
+};
+
+constexpr char TT_SHARED_MAGIC[8] = "SHZ-SHM";
+
 class TranspositionTable {
    public:
-    ~TranspositionTable() {
-        // This would only work with posix complient systems
-        // otherwise you would need alligned allocation and freeing
-        free(table);
+    ~TranspositionTable() { memory::large_free(allocation); }
+
+    // (re)allocate the table with 'mb' megabytes, this clears all entries
+    void resize(const std::size_t mb);
+    void clear();
+
+    // copies a verified entry for 'key' into 'data', returns false on a miss
+    bool probe(const uint64_t key, TT_data& data) const;
+
+    void save_entry(const uint64_t key, const TT_data& data);
+
+    // has to be called once before every new search so older entries start ageing.
+    // On a shared table the generation only moves if no other process moved it since this one's
+    // last search, so N processes starting a search for the same move advance it once, not N times
+    void new_search();
+
+    // permille of the sampled entries written during the current search
+    int hashfull() const;
+
+    // how many searches ago an entry with this age was written
+    uint8_t relative_age(const uint8_t age) const;
+
+    std::size_t index(const uint64_t key) const;
+
+    // start pulling the cluster of 'key' into the cache ahead of the probe
+    void prefetch(const uint64_t key) const { __builtin_prefetch(&table[index(key)]); }
+
+    // the current generation, read from the shared header when there is one so every attached
+    // process stamps and ages entries alike
+    uint8_t generation() const {
+        return shared ? shared->generation.load(std::memory_order_relaxed) & AGE_MASK : generations;
     }
 
-    TT_Entry* probe(const uint64_t key) const;
+    // which kind of pages back the table (see memory::large_alloc)
+    memory::AllocMode alloc_mode() const { return allocation.mode; }
+
+    // write the whole table to 'path' / map 'path' privately and use its buckets in place as the table
+    // both must only be called while no search is running, they return false on failure
+    bool save(const std::string& path) const;
+    bool load(const std::string& path);
 
-    void save_entry(const TT_Entry* entry);
+    // Back the table with the POSIX shared memory object 'name' (e.g. "/shahrazad-tt").
+    // The first process creates it with 'mb' megabytes, later ones attach to it whatever its size.
+    // Entries are shared with the same lock free guarantees as between threads. Returns false if the
+    // object can't be created or was made by an incompatible engine
+    bool attach_shared(const std::string& name, const std::size_t mb);
+
+    // remove the shared memory object, processes still attached keep their mapping
+    static bool remove_shared(const std::string& name);
+
+    // occupied entries per depth (deeper ones end up in the last bin) and per relative age
+    void occupancy(uint64_t (&by_depth)[64], uint64_t (&by_age)[MAX_AGE]) const;
+
+    // dump the summed thread counters together with the occupancy histograms
+    void print_stats(std::ostream& os, const TT_Stats& totals) const;
 
    protected:
     friend struct TT_Entry;
 
-    std::size_t capacity;  // remember to initialize this variable
-    std::size_t table_size  = 0;
-    TT_Bucket*  table       = nullptr;
-    uint8_t     generations = 0;
+    void allocate(const std::size_t buckets);
+
+    std::size_t        capacity    = 0;
+    std::size_t        table_size  = 0;
+    TT_Bucket*         table       = nullptr;
+    memory::Allocation allocation;
+    TT_SharedHeader*   shared      = nullptr;  // set while backed by shared memory
+    uint8_t            generations = 0;  // own generation, or the shared one as of this process' last search
 };
 
 }  // namespace tt
-}  // namespace Shahrazad
\ No newline at end of file
+}  // namespace Shahrazad
@@ -0,0 +1,185 @@
+// Kernel bit-exactness test : every kernel table this cpu can run has to give exactly the results of the
+// portable one (kernels_generic) on random inputs, for every kernel of the table
+
+#include "cpu.h"
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+
+using namespace Shahrazad;
+using Accumulator = nnue::NNue::Accumulator<nnue::size>;
+
+constexpr int NUM_ROWS       = 2 * 768;  // features of the test layer
+constexpr int ROUNDS         = 200;      // random cases per kernel
+constexpr int SPARSE_INPUTS  = 2 * nnue::size;
+constexpr int SPARSE_OUTPUTS = 32;
+
+alignas(64) static int16_t ft_weights[NUM_ROWS * nnue::size];
+alignas(64) static int16_t ft_biases[nnue::size];
+alignas(64) static int8_t  weights[SPARSE_INPUTS * SPARSE_OUTPUTS];
+alignas(64) static int32_t biases[SPARSE_OUTPUTS];
+
+static std::mt19937 rng(2024);
+
+static int random(int lo, int hi) { return std::uniform_int_distribution<int>(lo, hi)(rng); }
+
+static nnue::FeatureList random_features(int count) {
+    nnue::FeatureList list;
+
+    for (int i = 0; i < count; i++)
+        list.push_back(random(0, NUM_ROWS - 1));
+
+    return list;
+}
+
+static void random_accumulator(Accumulator& acc) {
+    for (auto& half : acc.accumulation)
+        for (int16_t& value : half)
+            value = random(-2000, 2000);
+}
+
+// uint8 activations, about 'zeros' percent of them zero as after the clipped ReLU
+static void random_activations(uint8_t* input, int count, int zeros) {
+    for (int i = 0; i < count; i++)
+        input[i] = random(0, 99) < zeros ? 0 : random(1, nnue::ACTIVATION_MAX);
+}
+
+static int failures = 0;
+
+static void check(const cpu::Kernels& table, const char* kernel, bool same) {
+    if (!same && failures++ < 20)
+        std::printf("%s : %s differs from generic\n", cpu::level_name(table.level), kernel);
+}
+
+static void test_accumulators(const cpu::Kernels& table, const nnue::LinearLayer& layer) {
+    const cpu::Kernels& generic = cpu::kernels_generic;
+    static Accumulator  prev, expected, got;
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        const auto perspective = round & 1 ? types::Color::BLACK : types::Color::WHITE;
+
+        // refresh : from the biases and up to 32 features
+        const nnue::FeatureList active = random_features(random(0, nnue::FeatureList::CAPACITY));
+        random_accumulator(expected);
+        got = expected;
+        generic.refresh_accumulator(layer, expected, active, perspective);
+        table.refresh_accumulator(layer, got, active, perspective);
+        check(table, "refresh_accumulator", std::memcmp(&expected, &got, sizeof(got)) == 0);
+
+        // update : the changes of a move, and some larger ones
+        const nnue::FeatureList removed = random_features(random(0, 4));
+        const nnue::FeatureList added   = random_features(random(0, 4));
+        random_accumulator(prev);
+        random_accumulator(expected);
+        got = expected;
+        generic.update_accumulator(layer, expected, prev, removed, added, perspective);
+        table.update_accumulator(layer, got, prev, removed, added, perspective);
+        check(table, "update_accumulator", std::memcmp(&expected, &got, sizeof(got)) == 0);
+
+        // both perspectives : the quiet move, capture and castling shapes have kernels of their own,
+        // the others go one perspective at a time
+        static const int shapes[][2] = {{1, 1}, {2, 1}, {2, 2}, {0, 1}, {1, 0}, {3, 2}};
+        const int*       shape       = shapes[round % 6];
+        nnue::FeatureList both_removed[2];
+        nnue::FeatureList both_added[2];
+
+        for (int p = 0; p < 2; p++)
+        {
+            both_removed[p] = random_features(shape[0]);
+            both_added[p]   = random_features(round % 12 < 6 ? shape[1] : random(0, 3));
+        }
+
+        random_accumulator(prev);
+        random_accumulator(expected);
+        got = expected;
+        generic.update_accumulators(layer, expected, prev, both_removed, both_added);
+        table.update_accumulators(layer, got, prev, both_removed, both_added);
+        check(table, "update_accumulators", std::memcmp(&expected, &got, sizeof(got)) == 0);
+    }
+}
+
+static void test_layers(const cpu::Kernels& table) {
+    const cpu::Kernels& generic = cpu::kernels_generic;
+
+    alignas(64) int16_t raw[SPARSE_INPUTS];
+    alignas(64) uint8_t input[SPARSE_INPUTS];
+    alignas(64) uint8_t relu_expected[SPARSE_INPUTS];
+    alignas(64) uint8_t relu_got[SPARSE_INPUTS];
+    alignas(64) int32_t expected[SPARSE_OUTPUTS];
+    alignas(64) int32_t got[SPARSE_OUTPUTS];
+
+    for (int round = 0; round < ROUNDS; round++)
+    {
+        // clipped ReLU, over the whole int16 range so both clamps are hit
+        for (int16_t& value : raw)
+            value = random(-32768, 32767) >> random(0, 8);
+
+        generic.clipped_relu_u8(raw, relu_expected, SPARSE_INPUTS);
+        table.clipped_relu_u8(raw, relu_got, SPARSE_INPUTS);
+        check(table, "clipped_relu_u8", std::memcmp(relu_expected, relu_got, sizeof(relu_got)) == 0);
+
+        // dense layer, the largest size and the smallest block the kernels take
+        for (int8_t& w : weights)
+            w = random(-128, 127);
+        for (int32_t& b : biases)
+            b = random(-100000, 100000);
+
+        for (const int num_inputs : {SPARSE_INPUTS, 64})
+        {
+            const int num_outputs = num_inputs == 64 ? 4 : SPARSE_OUTPUTS;
+
+            random_activations(input, num_inputs, round % 100);
+            generic.affine_u8i8(input, weights, biases, expected, num_inputs, num_outputs);
+            table.affine_u8i8(input, weights, biases, got, num_inputs, num_outputs);
+            check(table, "affine_u8i8", std::memcmp(expected, got, num_outputs * sizeof(int32_t)) == 0);
+        }
+
+        // sparse layer, from all zero to fully dense inputs
+        random_activations(input, SPARSE_INPUTS, round % 101);
+        generic.affine_sparse_u8i8(input, weights, biases, expected, SPARSE_INPUTS, SPARSE_OUTPUTS);
+        table.affine_sparse_u8i8(input, weights, biases, got, SPARSE_INPUTS, SPARSE_OUTPUTS);
+        check(table, "affine_sparse_u8i8", std::memcmp(expected, got, sizeof(got)) == 0);
+
+        // bit helpers
+        const uint64_t bits = (uint64_t(rng()) << 32 | rng()) >> random(0, 63);
+
+        check(table, "popcount", generic.popcount(bits) == table.popcount(bits));
+
+        if (bits)
+            check(table, "lsb", generic.lsb(bits) == table.lsb(bits));
+    }
+}
+
+int main() {
+    for (int16_t& w : ft_weights)
+        w = random(-128, 127);
+    for (int16_t& b : ft_biases)
+        b = random(-512, 511);
+
+    nnue::LinearLayer layer;
+    layer.attach(ft_weights, ft_biases, NUM_ROWS, nnue::size);
+
+    std::vector<const cpu::Kernels*> tables;
+#if defined(__x86_64__) || defined(_M_X64)
+    tables = {&cpu::kernels_sse41, &cpu::kernels_avx2, &cpu::kernels_bmi2, &cpu::kernels_avx512, &cpu::kernels_vnni};
+#endif
+
+    for (const cpu::Kernels* table : tables)
+    {
+        if (!cpu::supported(table->level))
+        {
+            std::printf("kernels %s : not supported here, skipped\n", cpu::level_name(table->level));
+            continue;
+        }
+
+        const int before = failures;
+        test_accumulators(*table, layer);
+        test_layers(*table);
+        std::printf("kernels %s : %s\n", cpu::level_name(table->level), failures == before ? "exact" : "DIFFERENT");
+    }
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,88 @@
+// Transposition table stress test : several threads store and probe entries in a few shared buckets at
+// once. Every entry is derived from its key, so a hit whose fields don't match its key is a torn write
+// that got past the key_xor check
+
+#include "ttable.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+
+using namespace Shahrazad;
+
+constexpr int ITERATIONS  = 1 << 21;  // per thread
+constexpr int BUCKET_BITS = 14;       // a 1 MB table has 1 << 14 buckets, picked by the top bits of the key
+constexpr int HOT_BITS    = 2;        // keys land in 1 << HOT_BITS of them
+
+// the entry every thread stores for 'key'
+static tt::TT_data expected(const uint64_t key) {
+    const uint64_t h = key * 0x9E3779B97F4A7C15ull;
+
+    return tt::TT_data(static_cast<int16_t>(h >> 16), static_cast<int16_t>((h >> 56) & 3), static_cast<uint16_t>(h),
+                       static_cast<int16_t>(h >> 32), key, static_cast<uint8_t>(h >> 48), (h >> 58) & 1);
+}
+
+static bool consistent(const tt::TT_data& got, const uint64_t key) {
+    const tt::TT_data want = expected(key);
+
+    return got.eval == want.eval && got.bound == want.bound && got.move == want.move && got.value == want.value
+        && got.depth == want.depth && got.was_pv == want.was_pv;
+}
+
+int main() {
+    tt::TranspositionTable table;
+    table.resize(1);
+
+    const int                threads = std::max(4u, std::thread::hardware_concurrency());
+    std::atomic<uint64_t>    hits{0};
+    std::atomic<uint64_t>    torn{0};
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++)
+    {
+        workers.emplace_back([&, t] {
+            uint64_t state      = 0x2545F4914F6CDD1Dull * (t + 1);
+            uint64_t local_hits = 0;
+            uint64_t local_torn = 0;
+
+            for (int i = 0; i < ITERATIONS; i++)
+            {
+                state ^= state << 13;
+                state ^= state >> 7;
+                state ^= state << 17;
+
+                // every bucket bit but HOT_BITS of them is zero, so all stores go to the same few buckets,
+                // and 64 distinct keys per bucket keep the threads overwriting each other's entries
+                const uint64_t hot = (state >> (64 - HOT_BITS)) << (64 - BUCKET_BITS);
+                const uint64_t key = hot | (((state & 63) + 1) * 0x10001);
+
+                if (i & 1)
+                {
+                    table.save_entry(key, expected(key));
+                    continue;
+                }
+
+                tt::TT_data data;
+
+                if (table.probe(key, data))
+                {
+                    local_hits++;
+                    local_torn += !consistent(data, key);
+                }
+            }
+
+            hits += local_hits;
+            torn += local_torn;
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    std::printf("tt stress : %d threads, %llu hits, %llu inconsistent\n", threads,
+                static_cast<unsigned long long>(hits.load()), static_cast<unsigned long long>(torn.load()));
+
+    return torn.load() == 0 && hits.load() > 0 ? 0 : 1;
+}